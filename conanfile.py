@@ -28,10 +28,20 @@ class CuraEngineInfillGeneratePluginConan(ConanFile):
     options = {
         "shared": [True, False],
         "fPIC": [True, False],
+        "enable_alloc_profiling": [True, False],
+        "enable_workload_generator": [True, False],
+        "enable_compression_benchmark": [True, False],
+        "enable_clip_check": [True, False],
+        "embed_tiles": ["ANY"],
     }
     default_options = {
         "shared": False,
         "fPIC": True,
+        "enable_alloc_profiling": False,
+        "enable_workload_generator": False,
+        "enable_compression_benchmark": False,
+        "enable_clip_check": False,
+        "embed_tiles": "",
     }
 
     def set_version(self):
@@ -125,6 +135,7 @@ class CuraEngineInfillGeneratePluginConan(ConanFile):
         copy(self, "CMakeLists.txt", self.recipe_folder, self.export_sources_folder)
         copy(self, "*", os.path.join(self.recipe_folder, "src"), os.path.join(self.export_sources_folder, "src"))
         copy(self, "*", os.path.join(self.recipe_folder, "include"), os.path.join(self.export_sources_folder, "include"))
+        copy(self, "*", os.path.join(self.recipe_folder, "proto"), os.path.join(self.export_sources_folder, "proto"))
         copy(self, "*", os.path.join(self.recipe_folder, "templates"), os.path.join(self.export_sources_folder, "templates"))
         copy(self, "*", os.path.join(self.recipe_folder, self._cura_plugin_name), os.path.join(self.export_sources_folder, self._cura_plugin_name))
 
@@ -157,6 +168,8 @@ class CuraEngineInfillGeneratePluginConan(ConanFile):
         self.requires("ctre/3.7.2")
         self.requires("neargye-semver/0.3.0")
         self.requires("curaengine_grpc_definitions/0.3.0")
+        if self.options.enable_compression_benchmark:
+            self.requires("zlib/[>=1.2.11 <2]")
 
     def validate(self):
         # validate the minimum cpp standard supported. For C++ projects only
@@ -183,6 +196,12 @@ class CuraEngineInfillGeneratePluginConan(ConanFile):
             tc.cache_variables["CMAKE_POLICY_DEFAULT_CMP0091"] = "NEW"
             tc.variables["USE_MSVC_RUNTIME_LIBRARY_DLL"] = not is_msvc_static_runtime(self)
         tc.cache_variables["CMAKE_POLICY_DEFAULT_CMP0077"] = "NEW"
+        tc.variables["ENABLE_ALLOC_PROFILING"] = self.options.enable_alloc_profiling
+        tc.variables["ENABLE_WORKLOAD_GENERATOR"] = self.options.enable_workload_generator
+        tc.variables["ENABLE_COMPRESSION_BENCHMARK"] = self.options.enable_compression_benchmark
+        tc.variables["ENABLE_CLIP_CHECK"] = self.options.enable_clip_check
+        if self.options.embed_tiles:
+            tc.variables["EMBED_TILES"] = str(self.options.embed_tiles)
         tc.generate()
 
         tc = CMakeDeps(self)
@@ -0,0 +1,197 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_ALLOC_PROFILER_H
+#define INFILL_ALLOC_PROFILER_H
+
+#include <cstdint>
+#include <string_view>
+
+#ifdef INFILL_ALLOC_PROFILING
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#endif
+
+namespace infill
+{
+
+/*! Heap activity of one thread, maintained by the operator new and delete replacements in src/alloc_profiler.cpp */
+struct AllocCounters
+{
+    std::uint64_t count{ 0 };
+    std::uint64_t bytes{ 0 };
+    std::int64_t live{ 0 };
+    std::int64_t peak{ 0 };
+};
+
+#ifdef INFILL_ALLOC_PROFILING
+
+AllocCounters& threadAllocCounters() noexcept;
+
+/*! Totals of all stages over the lifetime of the process, written to the log on shutdown */
+class AllocProfiler
+{
+public:
+    struct Totals
+    {
+        std::uint64_t calls{ 0 };
+        std::uint64_t count{ 0 };
+        std::uint64_t bytes{ 0 };
+        std::int64_t peak{ 0 };
+    };
+
+    static AllocProfiler& global()
+    {
+        static AllocProfiler profiler;
+        return profiler;
+    }
+
+    void record(std::string_view stage, const AllocCounters& delta)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto& totals = stages_[stage];
+        ++totals.calls;
+        totals.count += delta.count;
+        totals.bytes += delta.bytes;
+        totals.peak = std::max(totals.peak, delta.peak);
+    }
+
+    void report() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        for (const auto& [stage, totals] : stages_)
+        {
+            spdlog::info(
+                "[alloc] {}: calls: {}, allocations: {} ({:.1f} per call), bytes: {} ({:.1f} KiB per call), max peak: {:.1f} KiB",
+                stage,
+                totals.calls,
+                totals.count,
+                static_cast<double>(totals.count) / static_cast<double>(totals.calls),
+                totals.bytes,
+                static_cast<double>(totals.bytes) / static_cast<double>(totals.calls) / 1024.0,
+                static_cast<double>(totals.peak) / 1024.0);
+        }
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string_view, Totals> stages_;
+};
+
+namespace detail
+{
+inline thread_local std::vector<std::pair<std::string_view, AllocCounters>> request_stages;
+} // namespace detail
+
+/*! Counts the allocations made by the calling thread while the scope is alive
+ *
+ * The figures are inclusive of nested stages. Work handed to other threads, such as the clip partitions on the WorkPool,
+ * is only counted for the part the calling thread takes over itself. The peak is the highest number of bytes the
+ * thread held above what it held when the stage began. The stage name must outlive the process, use a literal.
+ */
+class AllocStage
+{
+public:
+    explicit AllocStage(std::string_view stage) noexcept
+        : stage_{ stage }
+        , start_{ threadAllocCounters() }
+    {
+        // Measure the peak relative to the start of the stage, the outer peak is restored when the stage ends.
+        threadAllocCounters().peak = start_.live;
+    }
+
+    AllocStage(const AllocStage&) = delete;
+    AllocStage& operator=(const AllocStage&) = delete;
+
+    ~AllocStage()
+    {
+        auto& counters = threadAllocCounters();
+        const AllocCounters delta{ .count = counters.count - start_.count,
+                                   .bytes = counters.bytes - start_.bytes,
+                                   .live = counters.live - start_.live,
+                                   .peak = counters.peak - start_.live };
+        counters.peak = std::max(start_.peak, counters.peak);
+        try
+        {
+            detail::request_stages.emplace_back(stage_, delta);
+            AllocProfiler::global().record(stage_, delta);
+        }
+        catch (...)
+        {
+            // Profiling must never fail the request it measures.
+        }
+    }
+
+private:
+    std::string_view stage_;
+    AllocCounters start_;
+};
+
+/*! Collects the stages of one request on the calling thread and writes them to the log when the request ends */
+class AllocRequest
+{
+public:
+    explicit AllocRequest(std::string_view label) noexcept
+        : label_{ label }
+    {
+        detail::request_stages.clear();
+    }
+
+    AllocRequest(const AllocRequest&) = delete;
+    AllocRequest& operator=(const AllocRequest&) = delete;
+
+    ~AllocRequest()
+    {
+        for (const auto& [stage, delta] : detail::request_stages)
+        {
+            spdlog::debug("[alloc] {} {}: allocations: {}, bytes: {}, peak: {}", label_, stage, delta.count, delta.bytes, delta.peak);
+        }
+        detail::request_stages.clear();
+    }
+
+private:
+    std::string_view label_;
+};
+
+#else
+
+class AllocProfiler
+{
+public:
+    static AllocProfiler& global()
+    {
+        static AllocProfiler profiler;
+        return profiler;
+    }
+
+    void report() const noexcept
+    {
+    }
+};
+
+class AllocStage
+{
+public:
+    explicit constexpr AllocStage(std::string_view) noexcept
+    {
+    }
+};
+
+class AllocRequest
+{
+public:
+    explicit constexpr AllocRequest(std::string_view) noexcept
+    {
+    }
+};
+
+#endif
+
+} // namespace infill
+
+#endif // INFILL_ALLOC_PROFILER_H
@@ -0,0 +1,198 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_ARENA_H
+#define INFILL_ARENA_H
+
+#include "infill/memory_governor.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace infill
+{
+
+/*! Pool of monotonic arenas used for the temporary geometry of a single generate request
+ *
+ * An arena hands out memory from one preallocated block and frees everything at once when the lease ends. Whenever a
+ * request needed more than the block, the block is grown to the observed size when the arena is returned, so the
+ * steady state of a request does not touch the global heap for its temporaries. Blocks grow up to max_capacity, a rare
+ * huge request takes the rest from the heap and returns it with its lease instead of pinning it in the pool.
+ */
+class ArenaPool
+{
+    /*! Upstream resource that records how much memory the arena had to request beyond its initial block */
+    class overflow_resource : public std::pmr::memory_resource
+    {
+    public:
+        std::size_t requested{ 0 };
+
+    private:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            requested += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+        {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    struct Arena
+    {
+        std::size_t capacity{ 0 };
+        std::unique_ptr<std::byte[]> block;
+        overflow_resource upstream;
+        std::optional<std::pmr::monotonic_buffer_resource> resource;
+
+        explicit Arena(std::size_t initial_capacity)
+        {
+            reserve(initial_capacity);
+        }
+
+        void reserve(std::size_t new_capacity)
+        {
+            resource.reset();
+            capacity = new_capacity;
+            block.reset(new std::byte[capacity]);
+            resource.emplace(block.get(), capacity, &upstream);
+        }
+
+        void reset()
+        {
+            const auto grown = std::min(capacity + upstream.requested, std::max(capacity, max_capacity));
+            upstream.requested = 0;
+            if (grown == capacity)
+            {
+                // Also hands the memory beyond the block back to the heap.
+                resource->release();
+                return;
+            }
+            reserve(grown);
+        }
+    };
+
+public:
+    class Lease
+    {
+    public:
+        Lease(ArenaPool* pool, std::unique_ptr<Arena> arena) noexcept
+            : pool_{ pool }
+            , arena_{ std::move(arena) }
+        {
+        }
+
+        Lease(Lease&&) noexcept = default;
+        Lease& operator=(Lease&&) noexcept = default;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease()
+        {
+            if (arena_)
+            {
+                pool_->recycle(std::move(arena_));
+            }
+        }
+
+        [[nodiscard]] std::pmr::memory_resource* resource() const noexcept
+        {
+            return &arena_->resource.value();
+        }
+
+    private:
+        ArenaPool* pool_;
+        std::unique_ptr<Arena> arena_;
+    };
+
+    static constexpr std::size_t initial_capacity{ 1 << 20 };
+    static constexpr std::size_t max_capacity{ 16 * initial_capacity }; //!< Largest block an idle arena keeps
+
+    ArenaPool()
+    {
+        registration_ = MemoryGovernor::global().add(
+            "arena pool",
+            MemoryGovernor::Priority::scratch,
+            [this]
+            {
+                std::scoped_lock lock{ mutex_ };
+                return free_bytes_;
+            },
+            [this](std::size_t bytes)
+            {
+                return shrink(bytes);
+            });
+    }
+
+    ArenaPool(const ArenaPool&) = delete;
+    ArenaPool& operator=(const ArenaPool&) = delete;
+
+    /*! The process wide pool, shared by all generate requests */
+    static ArenaPool& global()
+    {
+        static ArenaPool pool;
+        return pool;
+    }
+
+    [[nodiscard]] Lease acquire()
+    {
+        std::unique_lock lock{ mutex_ };
+        if (free_.empty())
+        {
+            lock.unlock();
+            return { this, std::make_unique<Arena>(initial_capacity) };
+        }
+        auto arena = std::move(free_.back());
+        free_.pop_back();
+        free_bytes_ -= arena->capacity;
+        return { this, std::move(arena) };
+    }
+
+    /*! Free idle arenas until at least bytes were released, returns the bytes released */
+    std::size_t shrink(std::size_t bytes)
+    {
+        std::vector<std::unique_ptr<Arena>> released;
+        std::size_t released_bytes{ 0 };
+        {
+            std::scoped_lock lock{ mutex_ };
+            while (released_bytes < bytes && ! free_.empty())
+            {
+                released_bytes += free_.back()->capacity;
+                released.push_back(std::move(free_.back()));
+                free_.pop_back();
+            }
+            free_bytes_ -= released_bytes;
+        }
+        return released_bytes;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Arena>> free_;
+    std::size_t free_bytes_{ 0 }; //!< Capacity of the idle arenas
+    MemoryGovernor::Registration registration_; //!< Declared last, so it is removed before the arenas
+
+    void recycle(std::unique_ptr<Arena> arena)
+    {
+        arena->reset();
+        std::scoped_lock lock{ mutex_ };
+        free_bytes_ += arena->capacity;
+        free_.push_back(std::move(arena));
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_ARENA_H
@@ -0,0 +1,79 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_CANCELLATION_H
+#define INFILL_CANCELLATION_H
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+namespace infill
+{
+
+/*! Thrown out of the generator when the request it works on was cancelled */
+struct Cancelled : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+/*! Thrown out of the generator when the request it works on ran past its deadline */
+struct DeadlineExceeded : public Cancelled
+{
+    using Cancelled::Cancelled;
+};
+
+/*! Shared by a request and the generator working on it, so the generator can stop as soon as the result is not wanted
+ *
+ * The request side calls cancel(), the generator calls check() between its stages and between partitions. A default
+ * constructed token is never cancelled and has no deadline.
+ */
+class CancellationToken
+{
+public:
+    using clock_t = std::chrono::system_clock;
+
+    CancellationToken() = default;
+
+    explicit CancellationToken(clock_t::time_point deadline) noexcept
+        : deadline_{ deadline }
+    {
+    }
+
+    /*! Only to be called before the token is handed to the generator */
+    void setDeadline(clock_t::time_point deadline) noexcept
+    {
+        deadline_ = deadline;
+    }
+
+    void cancel() noexcept
+    {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] bool isCancelled() const noexcept
+    {
+        return cancelled_.load(std::memory_order_relaxed) || clock_t::now() >= deadline_;
+    }
+
+    /*! Throw Cancelled if the request was cancelled, DeadlineExceeded if its deadline has passed */
+    void check() const
+    {
+        if (cancelled_.load(std::memory_order_relaxed))
+        {
+            throw Cancelled{ "Request was cancelled" };
+        }
+        if (clock_t::now() >= deadline_)
+        {
+            throw DeadlineExceeded{ "Request deadline exceeded" };
+        }
+    }
+
+private:
+    std::atomic<bool> cancelled_{ false };
+    clock_t::time_point deadline_{ clock_t::time_point::max() };
+};
+
+} // namespace infill
+
+#endif // INFILL_CANCELLATION_H
@@ -7,6 +7,7 @@
 #include <range/v3/range/concepts.hpp>
 
 #include <concepts>
+#include <cstdint>
 #include <string>
 #include <type_traits>
 
@@ -55,6 +56,14 @@ concept point2d_named = requires(T point) {
 template<class T>
 concept point2d = point2d_named<T> || (ranges::range<T> && std::integral<typename T::value_type> && std::tuple_size_v<T> == 2);
 
+/*!
+ * @brief A 2D point with 32-bit named coordinates, used to store geometry relative to a local origin.
+ * @details Such points are half the size of a ClipperLib::IntPoint and have to be widened to a full point before clipping.
+ * @tparam T Type to check
+ */
+template<class T>
+concept local_point2d = point2d_named<T> && std::same_as<decltype(T::X), std::int32_t> && std::same_as<decltype(T::Y), std::int32_t>;
+
 template<class T>
 concept point3d_named = requires(T point) {
     point.x;
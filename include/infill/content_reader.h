@@ -5,6 +5,7 @@
 #define INFILL_CONTENT_READER_H
 
 #include "infill/boost_tags.h"
+#include "infill/path_store.h"
 #include "infill/point_container.h"
 
 #include <boost/geometry/geometries/linestring.hpp>
@@ -15,45 +16,78 @@
 
 #include <filesystem>
 #include <fstream>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 
 namespace infill
 {
 
-std::tuple<std::vector<geometry::polyline<>>, std::vector<geometry::polygon_outer<>>> readContent(const std::filesystem::path& filepath)
+namespace detail
 {
-    std::vector<geometry::polygon_outer<>> polygons;
-    std::vector<geometry::polyline<>> linestrings;
+/*! Append the geometry of one line of a WKT file, lines without supported geometry are skipped */
+inline void readContentLine(const std::string& line, geometry::path_store<>& content)
+{
+    // Scratch geometries, read_wkt clears them before parsing so their capacity is reused for every line and every call.
+    thread_local geometry::polyline<> linestring;
+    thread_local boost::geometry::model::multi_linestring<geometry::polyline<>> multilinestring;
+    thread_local geometry::polygon_outer<> polygon;
+
+    if (line.empty())
+    {
+        return;
+    }
+    if (line.starts_with("LINESTRING"))
+    {
+        boost::geometry::read_wkt(line, linestring);
+        content.push_back(geometry::path_kind::polyline, linestring);
+    }
+    if (line.starts_with("MULTILINESTRING"))
+    {
+        boost::geometry::read_wkt(line, multilinestring);
+        for (const auto& part : multilinestring)
+        {
+            content.push_back(geometry::path_kind::polyline, part);
+        }
+    }
+    if (line.starts_with("POLYGON"))
+    {
+        boost::geometry::read_wkt(line, polygon);
+        content.push_back(geometry::path_kind::polygon, polygon);
+    }
+}
+} // namespace detail
+
+inline geometry::path_store<> readContent(const std::filesystem::path& filepath, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+{
+    geometry::path_store<> content{ resource };
+    thread_local std::string line;
 
     std::ifstream wkt_file(filepath);
-    std::string line;
 
     while (std::getline(wkt_file, line))
     {
-        if (line.empty())
-        {
-            continue;
-        }
-        if (line.starts_with("LINESTRING"))
-        {
-            geometry::polyline<> linestring;
-            boost::geometry::read_wkt(line, linestring);
-            linestrings.push_back(linestring);
-        }
-        if (line.starts_with("MULTILINESTRING"))
-        {
-            boost::geometry::model::multi_linestring<geometry::polyline<>> multilinestring;
-            boost::geometry::read_wkt(line, multilinestring);
-            linestrings.insert(linestrings.end(), multilinestring.begin(), multilinestring.end());
-        }
-        if (line.starts_with("POLYGON"))
-        {
-            geometry::polygon_outer<> polygon;
-            boost::geometry::read_wkt(line, polygon);
-            polygons.push_back(polygon);
-        }
+        detail::readContentLine(line, content);
+    }
+
+    return content;
+}
+
+/*! Parse the content of a WKT file that was already read into memory */
+inline geometry::path_store<> readContent(std::string_view text, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+{
+    geometry::path_store<> content{ resource };
+    thread_local std::string line;
+
+    while (! text.empty())
+    {
+        const auto end = text.find('\n');
+        line.assign(text.substr(0, end));
+        detail::readContentLine(line, content);
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
     }
 
-    return { linestrings, polygons };
+    return content;
 }
 } // namespace infill
 
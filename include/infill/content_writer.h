@@ -0,0 +1,67 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_CONTENT_WRITER_H
+#define INFILL_CONTENT_WRITER_H
+
+#include "infill/path_store.h"
+
+#include <fmt/format.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace infill
+{
+
+/*! Write the paths as WKT, one LINESTRING or POLYGON per line, in the format readContent reads back */
+inline void writeContent(const std::filesystem::path& filepath, const geometry::path_store<>& content)
+{
+    std::string text;
+    const auto append = [&text](const auto& path, bool closed)
+    {
+        for (const auto& point : path)
+        {
+            fmt::format_to(std::back_inserter(text), "{} {}, ", point.X, point.Y);
+        }
+        if (closed)
+        {
+            fmt::format_to(std::back_inserter(text), "{} {}, ", path.front().X, path.front().Y);
+        }
+        text.resize(text.size() - 2);
+    };
+    for (const auto& polyline : content.polylines())
+    {
+        if (polyline.empty())
+        {
+            continue;
+        }
+        text += "LINESTRING (";
+        append(polyline, false);
+        text += ")\n";
+    }
+    for (const auto& polygon : content.polygons())
+    {
+        if (polygon.empty())
+        {
+            continue;
+        }
+        text += "POLYGON ((";
+        append(polygon, true);
+        text += "))\n";
+    }
+
+    std::ofstream file{ filepath, std::ios::binary | std::ios::trunc };
+    file.write(text.data(), static_cast<std::streamsize>(text.size()));
+    if (! file)
+    {
+        throw std::runtime_error(fmt::format("Could not write {}", filepath.string()));
+    }
+}
+
+} // namespace infill
+
+#endif // INFILL_CONTENT_WRITER_H
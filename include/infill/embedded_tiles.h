@@ -0,0 +1,137 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_EMBEDDED_TILES_H
+#define INFILL_EMBEDDED_TILES_H
+
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+#include "infill/tile_geometry.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+namespace infill
+{
+
+/*! A tile file compiled into the executable, in the flat layout of TileGeometry
+ *
+ * Tiles are embedded by the tile_embedder tool when the plugin is configured with EMBED_TILES. A tile set is one
+ * directory of <z>_<pattern>.wkt files, it is selected with the infill directory embedded:<name of that directory>.
+ */
+struct EmbeddedTile
+{
+    std::string_view set;
+    std::string_view pattern;
+    std::int64_t z;
+    std::int64_t origin_x;
+    std::int64_t origin_y;
+    std::int64_t bounding_box[4];
+    std::span<const std::size_t> offsets;
+    std::span<const geometry::path_kind> kinds;
+    std::span<const geometry::LocalPoint> points;
+
+    /*! The tile as TileGeometry, viewing the embedded arrays without copying them */
+    [[nodiscard]] std::shared_ptr<const TileGeometry<>> geometry() const
+    {
+        auto tile = std::make_shared<TileGeometry<>>();
+        tile->paths.points = points;
+        tile->paths.offsets = offsets;
+        tile->paths.kinds = kinds;
+        tile->origin = { origin_x, origin_y };
+        tile->bounding_box = { { bounding_box[0], bounding_box[1] }, { bounding_box[2], bounding_box[3] } };
+        return tile;
+    }
+};
+
+#ifdef INFILL_EMBEDDED_TILES
+/*! All embedded tiles, ordered by set, pattern and z, defined in the generated embedded_tiles.cpp */
+std::span<const EmbeddedTile> embeddedTiles() noexcept;
+#else
+inline std::span<const EmbeddedTile> embeddedTiles() noexcept
+{
+    return {};
+}
+#endif
+
+/*! Marks an infill directory as the name of an embedded tile set
+ *
+ * Matching plain directories by their name alone would serve the embedded set for any directory on disk that happens to
+ * share it, so embedded sets are only used when asked for explicitly.
+ */
+inline constexpr std::string_view embedded_prefix{ "embedded:" };
+
+/*! The embedded layers of a pattern in the set of the given embedded:<set> directory, ordered by z */
+inline std::span<const EmbeddedTile> embeddedLayers(const std::filesystem::path& directory, std::string_view pattern)
+{
+    const auto tiles = embeddedTiles();
+    auto name = directory.generic_string();
+    if (tiles.empty() || ! name.starts_with(embedded_prefix))
+    {
+        return {};
+    }
+    while (name.ends_with('/'))
+    {
+        name.pop_back();
+    }
+    const auto set = std::string_view{ name }.substr(embedded_prefix.size());
+    const auto [first, last] = std::equal_range(
+        tiles.begin(),
+        tiles.end(),
+        std::tuple<std::string_view, std::string_view>{ set, pattern },
+        [](const auto& lhs, const auto& rhs)
+        {
+            const auto key = [](const auto& value)
+            {
+                if constexpr (std::is_same_v<std::decay_t<decltype(value)>, EmbeddedTile>)
+                {
+                    return std::tuple<std::string_view, std::string_view>{ value.set, value.pattern };
+                }
+                else
+                {
+                    return value;
+                }
+            };
+            return key(lhs) < key(rhs);
+        });
+    return { first, last };
+}
+
+/*! The embedded tile of the layer file embedded:<set>/<z>_<pattern>.wkt, or nullptr when it was not embedded */
+inline const EmbeddedTile* findEmbedded(const std::filesystem::path& filepath)
+{
+    if (embeddedTiles().empty())
+    {
+        return nullptr;
+    }
+    const auto stem = filepath.stem().string();
+    const auto separator = stem.find('_');
+    std::int64_t z{ 0 };
+    if (filepath.extension() != ".wkt" || separator == std::string::npos || std::from_chars(stem.data(), stem.data() + separator, z).ptr != stem.data() + separator)
+    {
+        return nullptr;
+    }
+    const auto layers = embeddedLayers(filepath.parent_path(), std::string_view{ stem }.substr(separator + 1));
+    const auto layer = std::lower_bound(
+        layers.begin(),
+        layers.end(),
+        z,
+        [](const EmbeddedTile& tile, std::int64_t value)
+        {
+            return tile.z < value;
+        });
+    return layer != layers.end() && layer->z == z ? &*layer : nullptr;
+}
+
+} // namespace infill
+
+#endif // INFILL_EMBEDDED_TILES_H
@@ -0,0 +1,270 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_FILE_READER_H
+#define INFILL_FILE_READER_H
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#ifdef INFILL_HAS_LIBURING
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace infill
+{
+
+/*! Reads whole files without blocking the calling thread
+ *
+ * Reads are submitted to io_uring when the plugin was built with liburing and the kernel allows a ring, and otherwise
+ * run as blocking reads on a small thread pool. Opening the file always happens on that pool. Either way the completion
+ * runs on a thread of the reader, so the gRPC context keeps serving other calls while the file is read.
+ */
+class FileReader
+{
+public:
+    using complete_t = std::function<void(std::exception_ptr, std::string)>;
+
+    explicit FileReader(std::size_t fallback_threads = 2)
+        : pool_{ fallback_threads }
+    {
+#ifdef INFILL_HAS_LIBURING
+        if (const auto error = ::io_uring_queue_init(queue_depth, &ring_, 0); error < 0)
+        {
+            spdlog::info("io_uring is not available ({}), reading tile files on a thread pool", std::system_category().message(-error));
+            return;
+        }
+        uring_ = true;
+        completions_ = std::thread{ [this]
+                                    {
+                                        reap();
+                                    } };
+#endif
+    }
+
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+
+    ~FileReader()
+    {
+        // Reads still starting on the pool submit to the ring, so the pool drains before the ring closes.
+        pool_.join();
+#ifdef INFILL_HAS_LIBURING
+        if (uring_)
+        {
+            {
+                std::scoped_lock lock{ mutex_ };
+                auto* sqe = nextSqe();
+                ::io_uring_prep_nop(sqe);
+                ::io_uring_sqe_set_data(sqe, nullptr);
+                ::io_uring_submit(&ring_);
+            }
+            completions_.join();
+            ::io_uring_queue_exit(&ring_);
+        }
+#endif
+    }
+
+    /*! Read the whole file and call complete with the outcome on a thread of the reader
+     *
+     * Opening the file and querying its size may block on a slow mount, so even the io_uring submission starts on
+     * the thread pool and never on the calling thread.
+     */
+    void read(std::filesystem::path filepath, complete_t complete)
+    {
+        boost::asio::post(
+            pool_,
+            [this, filepath = std::move(filepath), complete = std::move(complete)]() mutable
+            {
+#ifdef INFILL_HAS_LIBURING
+                if (uring_)
+                {
+                    submit(std::move(filepath), std::move(complete));
+                    return;
+                }
+#endif
+                std::exception_ptr error;
+                std::string content;
+                try
+                {
+                    content = readBlocking(filepath);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                complete(error, std::move(content));
+            });
+    }
+
+    /*! Run other blocking file system work, such as resolving or stating a file, on the threads of the reader */
+    template<class Function>
+    void post(Function&& function)
+    {
+        boost::asio::post(pool_, std::forward<Function>(function));
+    }
+
+private:
+    boost::asio::thread_pool pool_;
+
+    static std::string readBlocking(const std::filesystem::path& filepath)
+    {
+        std::ifstream file{ filepath, std::ios::binary };
+        if (! file)
+        {
+            throw std::runtime_error(fmt::format("Could not open {}", filepath.string()));
+        }
+        std::string content(static_cast<std::size_t>(std::filesystem::file_size(filepath)), '\0');
+        file.read(content.data(), static_cast<std::streamsize>(content.size()));
+        content.resize(static_cast<std::size_t>(file.gcount()));
+        return content;
+    }
+
+#ifdef INFILL_HAS_LIBURING
+    static constexpr unsigned queue_depth{ 64 };
+
+    /*! A read in flight, resubmitted for the remainder until the whole file arrived */
+    struct Request
+    {
+        int fd{ -1 };
+        std::filesystem::path filepath;
+        std::string content;
+        std::size_t offset{ 0 };
+        complete_t complete;
+
+        ~Request()
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+    };
+
+    bool uring_{ false };
+    io_uring ring_{};
+    std::mutex mutex_; //!< Guards the submission queue, completions are reaped by a single thread
+    std::thread completions_;
+
+    /*! A free submission queue entry, flushes the queue to the kernel when it is full, expects mutex_ to be held */
+    io_uring_sqe* nextSqe()
+    {
+        auto* sqe = ::io_uring_get_sqe(&ring_);
+        while (sqe == nullptr)
+        {
+            ::io_uring_submit(&ring_);
+            std::this_thread::yield();
+            sqe = ::io_uring_get_sqe(&ring_);
+        }
+        return sqe;
+    }
+
+    void submit(std::filesystem::path filepath, complete_t complete)
+    {
+        auto request = std::make_unique<Request>();
+        request->filepath = std::move(filepath);
+        request->complete = std::move(complete);
+        request->fd = ::open(request->filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info
+        {
+        };
+        if (request->fd < 0 || ::fstat(request->fd, &info) != 0)
+        {
+            fail(std::move(request), errno);
+            return;
+        }
+        request->content.resize(static_cast<std::size_t>(info.st_size));
+        if (request->content.empty())
+        {
+            finish(std::move(request));
+            return;
+        }
+        enqueue(std::move(request));
+    }
+
+    void enqueue(std::unique_ptr<Request> request)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto* sqe = nextSqe();
+        // A single read takes at most UINT_MAX bytes, larger files are read in several, see reap.
+        const auto length = std::min<std::size_t>(request->content.size() - request->offset, std::numeric_limits<unsigned>::max());
+        ::io_uring_prep_read(sqe, request->fd, request->content.data() + request->offset, static_cast<unsigned>(length), request->offset);
+        ::io_uring_sqe_set_data(sqe, request.release());
+        ::io_uring_submit(&ring_);
+    }
+
+    void reap()
+    {
+        while (true)
+        {
+            io_uring_cqe* cqe{ nullptr };
+            if (const auto error = ::io_uring_wait_cqe(&ring_, &cqe); error < 0)
+            {
+                if (error == -EINTR)
+                {
+                    continue;
+                }
+                spdlog::error("Waiting for io_uring completions failed: {}", std::system_category().message(-error));
+                return;
+            }
+            std::unique_ptr<Request> request{ static_cast<Request*>(::io_uring_cqe_get_data(cqe)) };
+            const auto result = cqe->res;
+            ::io_uring_cqe_seen(&ring_, cqe);
+            if (request == nullptr)
+            {
+                return;
+            }
+
+            if (result < 0)
+            {
+                fail(std::move(request), -result);
+                continue;
+            }
+            request->offset += static_cast<std::size_t>(result);
+            if (result == 0 || request->offset == request->content.size())
+            {
+                // A file that shrank while it was read ends early, it is taken as it is.
+                request->content.resize(request->offset);
+                finish(std::move(request));
+                continue;
+            }
+            enqueue(std::move(request));
+        }
+    }
+
+    static void fail(std::unique_ptr<Request> request, int error)
+    {
+        request->complete(std::make_exception_ptr(std::system_error(error, std::system_category(), fmt::format("Could not read {}", request->filepath.string()))), {});
+    }
+
+    static void finish(std::unique_ptr<Request> request)
+    {
+        request->complete(nullptr, std::move(request->content));
+    }
+#endif
+};
+
+} // namespace infill
+
+#endif // INFILL_FILE_READER_H
@@ -4,12 +4,23 @@
 #ifndef CURAENGINE_PLUGIN_INFILL_GENERATE_INCLUDE_INFILL_GEOMETRY_H
 #define CURAENGINE_PLUGIN_INFILL_GENERATE_INCLUDE_INFILL_GEOMETRY_H
 
+#include "infill/alloc_profiler.h"
+#include "infill/cancellation.h"
+#include "infill/islands.h"
+#include "infill/path_store.h"
 #include "infill/point_container.h"
+#include "infill/work_pool.h"
 #include "polyclipping/clipper.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <functional>
+#include <limits>
+#include <memory_resource>
 #include <numbers>
 #include <numeric>
+#include <vector>
 
 namespace infill::geometry
 {
@@ -45,37 +56,395 @@ static ClipperLib::IntPoint computeCoG(const auto& contour)
     return cog;
 }
 
-static ClipperLib::Paths clip(const auto& polys, const bool& is_poly_closed, const std::vector<geometry::polygon_outer<>>& outer_contours)
+/*! The Clipper instance of the calling thread, cleared but with its internal buffers kept from previous calls */
+static ClipperLib::Clipper& threadClipper()
 {
-    ClipperLib::Clipper clipper;
-    ClipperLib::Paths outline_poly;
-    for (const auto& poly : outer_contours)
+    thread_local ClipperLib::Clipper clipper;
+    clipper.Clear();
+    return clipper;
+}
+
+/*! A coarser copy of the paths, for a request that would not finish in time otherwise
+ *
+ * Points closer than tolerance to the previously kept point are dropped, the ends of open paths are always kept. Paths
+ * whose bounding box is smaller than min_extent in both directions are dropped, as are polygons left with fewer than
+ * three points.
+ */
+static path_store<> simplify(const path_store<>& paths, const ClipperLib::cInt tolerance, const ClipperLib::cInt min_extent, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+{
+    path_store<> ret{ resource };
+    ret.reserve(paths.size(), paths.points().size());
+    const auto squared_tolerance = static_cast<double>(tolerance) * static_cast<double>(tolerance);
+    const auto close = [squared_tolerance](const Point& lhs, const Point& rhs)
+    {
+        const auto dx = static_cast<double>(lhs.X - rhs.X);
+        const auto dy = static_cast<double>(lhs.Y - rhs.Y);
+        return dx * dx + dy * dy < squared_tolerance;
+    };
+    thread_local ClipperLib::Path kept;
+    for (std::size_t index = 0; index < paths.size(); ++index)
     {
-        outline_poly.push_back(poly);
+        const auto kind = paths.kind(index);
+        const auto path = paths.path(index);
+        if (kind == path_kind::discarded || path.empty())
+        {
+            continue;
+        }
+        if (min_extent > 0)
+        {
+            const auto bb = computeBoundingBox(path);
+            if (bb.back().X - bb.front().X < min_extent && bb.back().Y - bb.front().Y < min_extent)
+            {
+                continue;
+            }
+        }
+
+        kept.assign(1, path.front());
+        for (const auto& point : path.subspan(1))
+        {
+            if (! close(point, kept.back()))
+            {
+                kept.push_back(point);
+            }
+        }
+        if (kind == path_kind::polyline && kept.back() != path.back())
+        {
+            if (kept.size() > 1)
+            {
+                kept.back() = path.back();
+            }
+            else
+            {
+                kept.push_back(path.back());
+            }
+        }
+        if (kept.size() >= (kind == path_kind::polygon ? 3 : 2))
+        {
+            ret.push_back(kind, kept);
+        }
     }
-    clipper.AddPaths(outline_poly, ClipperLib::PolyType::ptClip, true);
+    return ret;
+}
 
-    ClipperLib::Paths grid_poly;
-    for (auto& poly : polys)
+/*! Clip the paths against the outline and append the result to ret */
+static void clip(const auto& polys, const bool& is_poly_closed, const auto& outer_contours, path_store<>& ret)
+{
+    auto& clipper = threadClipper();
+    for (const auto& poly : outer_contours)
     {
-        grid_poly.push_back(poly);
+        clipper.AddPath(poly, ClipperLib::PolyType::ptClip, true);
     }
-    clipper.AddPaths(grid_poly, ClipperLib::PolyType::ptSubject, is_poly_closed);
 
-    ClipperLib::Paths ret;
-    if (! is_poly_closed)
+    // Paths are handed to Clipper one by one through a reused scratch path, instead of collecting them in fresh Paths.
+    // Clipper 6 only accepts its own Path type and copies it into its edge list anyway, so this is the only extra copy.
+    thread_local ClipperLib::Path scratch;
+    for (const auto& poly : polys)
     {
-        ClipperLib::PolyTree result;
-        clipper.Execute(ClipperLib::ClipType::ctIntersection, result);
-        ClipperLib::OpenPathsFromPolyTree(result, ret);
+        scratch.assign(poly.begin(), poly.end());
+        clipper.AddPath(scratch, ClipperLib::PolyType::ptSubject, is_poly_closed);
     }
-    else
+
+    // Walk the tree instead of flattening it into Paths first, so every resulting contour is copied exactly once.
+    thread_local ClipperLib::PolyTree result;
+    clipper.Execute(ClipperLib::ClipType::ctIntersection, result);
+    const auto kind = is_poly_closed ? path_kind::polygon : path_kind::polyline;
+    for (auto* node = result.GetFirst(); node != nullptr; node = node->GetNext())
     {
-        clipper.Execute(ClipperLib::ClipType::ctIntersection, ret);
+        if (node->IsOpen() != is_poly_closed)
+        {
+            ret.push_back(kind, node->Contour);
+        }
     }
+}
+
+static path_store<> clip(const auto& polys, const bool& is_poly_closed, const auto& outer_contours, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+{
+    path_store<> ret{ resource };
+    clip(polys, is_poly_closed, outer_contours, ret);
     return ret;
 }
 
+/*! A tile path to be clipped in a group, with the box it covers */
+template<class View>
+struct PathEntry
+{
+    View path;
+    BoundingBox bounding_box;
+};
+
+/*! The non-empty paths with their bounding boxes, empty paths never contribute to a clip */
+static auto pathEntries(const auto& polys)
+{
+    using view_t = std::decay_t<decltype(*std::begin(polys))>;
+    std::vector<PathEntry<view_t>> entries;
+    for (const auto& poly : polys)
+    {
+        if (std::begin(poly) != std::end(poly))
+        {
+            entries.push_back({ poly, computeBoundingBox(poly) });
+        }
+    }
+    return entries;
+}
+
+/*! Tile paths clipped together, by index into their entries, with the box they cover */
+struct PathGroup
+{
+    std::vector<std::size_t> paths;
+    BoundingBox bounding_box{ { std::numeric_limits<ClipperLib::cInt>::max(), std::numeric_limits<ClipperLib::cInt>::max() },
+                              { std::numeric_limits<ClipperLib::cInt>::min(), std::numeric_limits<ClipperLib::cInt>::min() } };
+};
+
+static bool overlaps(const BoundingBox& lhs, const BoundingBox& rhs)
+{
+    return lhs.front().X <= rhs.back().X && lhs.back().X >= rhs.front().X && lhs.front().Y <= rhs.back().Y && lhs.back().Y >= rhs.front().Y;
+}
+
+/*! Split the entries into up to count groups of neighbouring paths with about the same number of points
+ *
+ * The paths are ordered by their left end and cut into runs. Clipper clips every open path on its own, so open paths can
+ * be grouped freely. Closed paths are merged with the other closed paths they overlap or touch, so those stay in one
+ * group: a group only ends where no path before it reaches as far right as the next path starts.
+ */
+static std::vector<PathGroup> pathGroups(const auto& entries, const std::size_t count, const bool& is_poly_closed)
+{
+    std::vector<std::size_t> order(entries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(
+        order.begin(),
+        order.end(),
+        [&entries](std::size_t lhs, std::size_t rhs)
+        {
+            return entries[lhs].bounding_box.front().X < entries[rhs].bounding_box.front().X;
+        });
+    std::size_t total{ 0 };
+    for (const auto& entry : entries)
+    {
+        total += static_cast<std::size_t>(std::size(entry.path));
+    }
+    const auto target = std::max<std::size_t>(1, total / std::max<std::size_t>(1, count));
+
+    std::vector<PathGroup> groups;
+    std::size_t points{ 0 };
+    auto reached = std::numeric_limits<ClipperLib::cInt>::min();
+    for (const auto index : order)
+    {
+        const auto& bb = entries[index].bounding_box;
+        const auto separate = ! is_poly_closed || bb.front().X > reached;
+        if (groups.empty() || (separate && groups.size() < count && points >= target * groups.size()))
+        {
+            groups.emplace_back();
+        }
+        auto& group = groups.back();
+        group.paths.push_back(index);
+        group.bounding_box = { { std::min(group.bounding_box.front().X, bb.front().X), std::min(group.bounding_box.front().Y, bb.front().Y) },
+                               { std::max(group.bounding_box.back().X, bb.back().X), std::max(group.bounding_box.back().Y, bb.back().Y) } };
+        points += static_cast<std::size_t>(std::size(entries[index].path));
+        reached = std::max(reached, bb.back().X);
+    }
+    return groups;
+}
+
+/*! Clip the paths of the group against the contours reaching into its box and append the result to ret
+ *
+ * A contour outside the box neither crosses a path of the group nor encloses one of its points, so leaving it out does
+ * not change the result.
+ */
+static void clipGroup(const auto& entries, const PathGroup& group, const bool& is_poly_closed, const auto& outer_contours, path_store<>& ret)
+{
+    using contour_t = std::decay_t<decltype(*std::begin(outer_contours))>;
+    std::vector<std::reference_wrapper<const contour_t>> contours;
+    for (const auto& contour : outer_contours)
+    {
+        if (! contour.empty() && overlaps(computeBoundingBox(contour), group.bounding_box))
+        {
+            contours.emplace_back(contour);
+        }
+    }
+    if (contours.empty())
+    {
+        return;
+    }
+
+    using view_t = decltype(std::begin(entries)->path);
+    std::vector<view_t> paths;
+    paths.reserve(group.paths.size());
+    for (const auto index : group.paths)
+    {
+        paths.push_back(entries[index].path);
+    }
+    clip(paths, is_poly_closed, contours, ret);
+}
+
+/*! Clip against the outline in groups of tile paths, which are clipped in parallel on the given pool
+ *
+ * The tile paths are split by pathGroups, so no path is cut between two groups and the groups are only appended one
+ * after the other. The result covers the same paths as the serial clip, only in another order. The result is appended
+ * to ret.
+ *
+ * Throws Cancelled from the cancellation token before each group and before the groups are joined.
+ */
+static void clip(
+    const auto& polys,
+    const bool& is_poly_closed,
+    const auto& outer_contours,
+    const std::size_t partitions,
+    WorkPool& pool,
+    const CancellationToken& cancellation,
+    path_store<>& ret)
+{
+    const AllocStage alloc_stage{ "clip" };
+    cancellation.check();
+    if (std::empty(outer_contours))
+    {
+        return;
+    }
+    if (partitions <= 1)
+    {
+        clip(polys, is_poly_closed, outer_contours, ret);
+        return;
+    }
+
+    const auto entries = pathEntries(polys);
+    const auto groups = pathGroups(entries, partitions, is_poly_closed);
+    std::vector<path_store<>> results(groups.size());
+    pool.parallelFor(
+        groups.size(),
+        [&](std::size_t k)
+        {
+            // Remaining groups are dropped as soon as the request is cancelled, parallelFor rethrows once all returned.
+            cancellation.check();
+            clipGroup(entries, groups[k], is_poly_closed, outer_contours, results[k]);
+        });
+    cancellation.check();
+    for (const auto& result : results)
+    {
+        ret.append(result);
+    }
+}
+
+/*! Clip every island on its own, against only the tile paths reaching into its bounding box
+ *
+ * The islands are registered in a grid of about one cell per island, so a path is only tested against the islands of
+ * the cells it covers. The islands are clipped in parallel on the pool, a layer of a single island is clipped in
+ * partitions instead. Islands do not overlap, so the result covers the same geometry as the clip against all contours
+ * at once. The result is appended to ret, island by island.
+ *
+ * Throws Cancelled from the cancellation token before each island and before the islands are joined.
+ */
+static void clip(
+    const auto& polys,
+    const bool& is_poly_closed,
+    const Islands& islands,
+    const std::size_t partitions,
+    WorkPool& pool,
+    const CancellationToken& cancellation,
+    path_store<>& ret)
+{
+    if (islands.size() <= 1)
+    {
+        clip(polys, is_poly_closed, islands.contours(), partitions, pool, cancellation, ret);
+        return;
+    }
+    const AllocStage alloc_stage{ "clip" };
+    cancellation.check();
+
+    std::vector<BoundingBox> boxes;
+    boxes.reserve(islands.size());
+    ClipperLib::IntPoint p_min{ std::numeric_limits<ClipperLib::cInt>::max(), std::numeric_limits<ClipperLib::cInt>::max() };
+    ClipperLib::IntPoint p_max{ std::numeric_limits<ClipperLib::cInt>::min(), std::numeric_limits<ClipperLib::cInt>::min() };
+    for (std::size_t k = 0; k < islands.size(); ++k)
+    {
+        const auto& bb = boxes.emplace_back(computeBoundingBox(islands.island(k).front()));
+        p_min = { std::min(p_min.X, bb.front().X), std::min(p_min.Y, bb.front().Y) };
+        p_max = { std::max(p_max.X, bb.back().X), std::max(p_max.Y, bb.back().Y) };
+    }
+    if (p_min.X > p_max.X)
+    {
+        return;
+    }
+
+    const auto columns = static_cast<ClipperLib::cInt>(std::ceil(std::sqrt(static_cast<double>(islands.size()))));
+    const auto cell_width = (p_max.X - p_min.X) / columns + 1;
+    const auto cell_height = (p_max.Y - p_min.Y) / columns + 1;
+    const auto cells_of = [&](const BoundingBox& bb)
+    {
+        const auto column = [&](ClipperLib::cInt x)
+        {
+            return std::clamp<ClipperLib::cInt>((x - p_min.X) / cell_width, 0, columns - 1);
+        };
+        const auto row = [&](ClipperLib::cInt y)
+        {
+            return std::clamp<ClipperLib::cInt>((y - p_min.Y) / cell_height, 0, columns - 1);
+        };
+        return std::array{ column(bb.front().X), row(bb.front().Y), column(bb.back().X), row(bb.back().Y) };
+    };
+    std::vector<std::vector<std::size_t>> cells(static_cast<std::size_t>(columns * columns));
+    for (std::size_t k = 0; k < boxes.size(); ++k)
+    {
+        if (boxes[k].front().X > boxes[k].back().X)
+        {
+            continue;
+        }
+        const auto [x0, y0, x1, y1] = cells_of(boxes[k]);
+        for (auto y = y0; y <= y1; ++y)
+        {
+            for (auto x = x0; x <= x1; ++x)
+            {
+                cells[static_cast<std::size_t>(y * columns + x)].push_back(k);
+            }
+        }
+    }
+
+    // Hand every path to the islands whose bounding box it touches, a path may reach into several islands.
+    using view_t = std::decay_t<decltype(*std::begin(polys))>;
+    std::vector<std::vector<view_t>> reaching(islands.size());
+    std::vector<std::size_t> seen(islands.size(), std::numeric_limits<std::size_t>::max());
+    std::size_t path{ 0 };
+    for (const auto& poly : polys)
+    {
+        ++path;
+        const auto bb = computeBoundingBox(poly);
+        if (poly.empty() || bb.back().X < p_min.X || bb.front().X > p_max.X || bb.back().Y < p_min.Y || bb.front().Y > p_max.Y)
+        {
+            continue;
+        }
+        const auto [x0, y0, x1, y1] = cells_of(bb);
+        for (auto y = y0; y <= y1; ++y)
+        {
+            for (auto x = x0; x <= x1; ++x)
+            {
+                for (const auto k : cells[static_cast<std::size_t>(y * columns + x)])
+                {
+                    const auto& box = boxes[k];
+                    if (seen[k] != path && bb.front().X <= box.back().X && bb.back().X >= box.front().X && bb.front().Y <= box.back().Y && bb.back().Y >= box.front().Y)
+                    {
+                        seen[k] = path;
+                        reaching[k].push_back(poly);
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<path_store<>> results(islands.size());
+    pool.parallelFor(
+        islands.size(),
+        [&](std::size_t k)
+        {
+            cancellation.check();
+            if (! reaching[k].empty())
+            {
+                clip(reaching[k], is_poly_closed, islands.island(k), results[k]);
+            }
+        });
+    cancellation.check();
+    for (const auto& result : results)
+    {
+        ret.append(result);
+    }
+}
+
 } // namespace infill::geometry
 
 
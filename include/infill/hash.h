@@ -0,0 +1,57 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_HASH_H
+#define INFILL_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+namespace infill
+{
+
+/*! Incremental 64-bit FNV-1a hash, used for cache keys and file names, not for anything security relevant */
+class Fnv1a
+{
+public:
+    Fnv1a& update(std::span<const std::byte> bytes) noexcept
+    {
+        for (const auto byte : bytes)
+        {
+            value_ = (value_ ^ static_cast<std::uint8_t>(byte)) * 0x100000001b3;
+        }
+        return *this;
+    }
+
+    Fnv1a& update(std::string_view text) noexcept
+    {
+        return update(std::as_bytes(std::span{ text.data(), text.size() }));
+    }
+
+    template<class T>
+    requires std::is_trivially_copyable_v<T> && std::has_unique_object_representations_v<T>
+    Fnv1a& update(const T& value) noexcept
+    {
+        return update(std::as_bytes(std::span{ &value, 1 }));
+    }
+
+    [[nodiscard]] std::uint64_t value() const noexcept
+    {
+        return value_;
+    }
+
+    static std::uint64_t of(std::string_view text) noexcept
+    {
+        return Fnv1a{}.update(text).value();
+    }
+
+private:
+    std::uint64_t value_{ 0xcbf29ce484222325 };
+};
+
+} // namespace infill
+
+#endif // INFILL_HASH_H
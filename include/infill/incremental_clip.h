@@ -0,0 +1,330 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_INCREMENTAL_CLIP_H
+#define INFILL_INCREMENTAL_CLIP_H
+
+#include "infill/cancellation.h"
+#include "infill/geometry.h"
+#include "infill/hash.h"
+#include "infill/islands.h"
+#include "infill/memory_governor.h"
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+#include "infill/tile_geometry.h"
+#include "infill/work_pool.h"
+
+#include <polyclipping/clipper.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace infill
+{
+
+/*! Clips consecutive layers of the same tile by patching the result of the previous layer
+ *
+ * The content is split into groups of neighbouring paths by geometry::pathGroups, and the outline and group results of
+ * the last layer are kept per key. The next layer with the same key computes the symmetric difference of the old and the
+ * new outline and only re-clips the groups that difference reaches into, all other groups are taken over from the
+ * previous layer. Tall parts whose cross-section changes slowly only pay for the groups that changed. The groups split
+ * the paths of the tile, not the plane, so the reused results are joined without any stitching and the layer matches
+ * the serial clip exactly, island by island for layers of several islands.
+ *
+ * The symmetric difference decides which groups are reused, the key only decides which layer is compared against. A
+ * wrong match costs time, never correctness. The least recently used layers are dropped once more than capacity are kept,
+ * or when the memory governor asks for memory.
+ */
+class IncrementalClip
+{
+public:
+    static constexpr std::size_t group_count{ 32 };
+
+    explicit IncrementalClip(std::size_t capacity = 64)
+        : capacity_{ capacity }
+    {
+        registration_ = MemoryGovernor::global().add(
+            "incremental clip layers",
+            MemoryGovernor::Priority::derived,
+            [this]
+            {
+                std::scoped_lock lock{ mutex_ };
+                return size_;
+            },
+            [this](std::size_t bytes)
+            {
+                return shrink(bytes);
+            });
+    }
+
+    /*! Drop the least recently used layers until at least bytes were released, returns the bytes released */
+    std::size_t shrink(std::size_t bytes)
+    {
+        std::scoped_lock lock{ mutex_ };
+        const auto before = size_;
+        while (before - size_ < bytes && ! lru_.empty())
+        {
+            erase(entries_.find(lru_.back()));
+        }
+        return before - size_;
+    }
+
+    /*! Key of the layers of one engine clipping the same tile file at the same scale and position */
+    static std::uint64_t key(std::string_view session, const std::filesystem::path& content_path, const int64_t infill_scale, const int64_t center_x, const int64_t center_y)
+    {
+        const auto stamp = FileStamp::of(content_path);
+        return Fnv1a{}.update(session).update(content_path.string()).update(stamp.modified).update(stamp.file_size).update(infill_scale).update(center_x).update(center_y).value();
+    }
+
+    /*! Clip the content against the islands and append the result to ret, reusing the groups that did not change
+     *
+     * A group is clipped island by island like geometry::clip does for several islands. It is reused when the symmetric
+     * difference of the outlines stays outside its bounding box and the contour edges reaching into that box are the
+     * same as for the previous layer, so it would be clipped against the same edges and the same region. The groups are
+     * clipped on the pool when the layer is to be clipped in partitions, and on the calling thread otherwise.
+     *
+     * Throws Cancelled from the cancellation token before each group and before the groups are joined.
+     */
+    void clip(
+        const std::uint64_t key,
+        const geometry::path_store<>& content,
+        const geometry::Islands& islands,
+        const std::size_t partitions,
+        WorkPool& pool,
+        const CancellationToken& cancellation,
+        geometry::path_store<>& ret)
+    {
+        const auto& outer_contours = islands.contours();
+        const auto polylines = geometry::pathEntries(content.polylines());
+        const auto polygons = geometry::pathEntries(content.polygons());
+        auto layer = std::make_shared<Layer>();
+        layer->contours = outer_contours;
+        layer->groups = geometry::pathGroups(polylines, group_count, false);
+        const auto polyline_groups = layer->groups.size();
+        for (auto& group : geometry::pathGroups(polygons, group_count, true))
+        {
+            layer->groups.push_back(std::move(group));
+        }
+        layer->results.resize(layer->groups.size());
+        layer->edges.reserve(layer->groups.size());
+        for (const auto& group : layer->groups)
+        {
+            layer->edges.push_back(edgeDigest(outer_contours, group.bounding_box));
+        }
+
+        std::vector<bool> changed(layer->groups.size(), true);
+        const auto previous = find(key);
+        if (previous != nullptr && sameGroups(previous->groups, layer->groups))
+        {
+            for (std::size_t k = 0; k < layer->groups.size(); ++k)
+            {
+                changed[k] = previous->edges[k] != layer->edges[k];
+            }
+            for (const auto& piece : difference(previous->contours, outer_contours))
+            {
+                const auto piece_bb = geometry::computeBoundingBox(piece);
+                for (std::size_t k = 0; k < layer->groups.size(); ++k)
+                {
+                    changed[k] = changed[k] || geometry::overlaps(piece_bb, layer->groups[k].bounding_box);
+                }
+            }
+        }
+
+        std::vector<std::size_t> dirty;
+        for (std::size_t k = 0; k < layer->groups.size(); ++k)
+        {
+            if (changed[k])
+            {
+                dirty.push_back(k);
+            }
+            else
+            {
+                layer->results[k] = previous->results[k];
+            }
+        }
+        spdlog::debug("Re-clipping {} of {} groups", dirty.size(), layer->groups.size());
+
+        const auto clipDirty = [&](std::size_t index)
+        {
+            cancellation.check();
+            const auto k = dirty[index];
+            const auto is_poly_closed = k >= polyline_groups;
+            for (std::size_t island = 0; island < std::max<std::size_t>(1, islands.size()); ++island)
+            {
+                const auto contours = islands.size() <= 1 ? std::span{ outer_contours } : islands.island(island);
+                if (is_poly_closed)
+                {
+                    geometry::clipGroup(polygons, layer->groups[k], true, contours, layer->results[k]);
+                }
+                else
+                {
+                    geometry::clipGroup(polylines, layer->groups[k], false, contours, layer->results[k]);
+                }
+            }
+        };
+        if (partitions > 1)
+        {
+            pool.parallelFor(dirty.size(), clipDirty);
+        }
+        else
+        {
+            for (std::size_t index = 0; index < dirty.size(); ++index)
+            {
+                clipDirty(index);
+            }
+        }
+        cancellation.check();
+
+        for (const auto& result : layer->results)
+        {
+            ret.append(result);
+        }
+        layer->memory = layer->memoryUsage();
+        store(key, std::move(layer));
+    }
+
+private:
+    struct Layer
+    {
+        std::vector<geometry::polygon_outer<>> contours;
+        std::vector<geometry::PathGroup> groups; //!< The groups of the polylines followed by those of the polygons
+        std::vector<geometry::path_store<>> results; //!< Clip result per group
+        std::vector<std::uint64_t> edges; //!< Digest of the contour edges reaching into each group, see edgeDigest
+        std::size_t memory{ 0 };
+
+        [[nodiscard]] std::size_t memoryUsage() const noexcept
+        {
+            auto bytes = sizeof(Layer);
+            for (const auto& contour : contours)
+            {
+                bytes += contour.capacity() * sizeof(geometry::Point);
+            }
+            for (const auto& group : groups)
+            {
+                bytes += sizeof(geometry::PathGroup) + group.paths.capacity() * sizeof(std::size_t);
+            }
+            for (const auto& result : results)
+            {
+                bytes += result.memoryUsage();
+            }
+            return bytes + edges.capacity() * sizeof(std::uint64_t);
+        }
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<const Layer> layer;
+        std::list<std::uint64_t>::iterator position;
+    };
+
+    std::size_t capacity_;
+    std::size_t size_{ 0 }; //!< Memory of all kept layers
+    std::mutex mutex_;
+    std::unordered_map<std::uint64_t, Entry> entries_;
+    std::list<std::uint64_t> lru_;
+    MemoryGovernor::Registration registration_; //!< Declared last, so it is removed before the entries
+
+    std::shared_ptr<const Layer> find(std::uint64_t key)
+    {
+        std::scoped_lock lock{ mutex_ };
+        if (auto it = entries_.find(key); it != entries_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.position);
+            return it->second.layer;
+        }
+        return nullptr;
+    }
+
+    void store(std::uint64_t key, std::shared_ptr<const Layer> layer)
+    {
+        std::scoped_lock lock{ mutex_ };
+        size_ += layer->memory;
+        if (auto it = entries_.find(key); it != entries_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.position);
+            size_ -= it->second.layer->memory;
+            it->second.layer = std::move(layer);
+            return;
+        }
+        lru_.push_front(key);
+        entries_.insert_or_assign(key, Entry{ .layer = std::move(layer), .position = lru_.begin() });
+        while (entries_.size() > capacity_)
+        {
+            erase(entries_.find(lru_.back()));
+        }
+    }
+
+    void erase(std::unordered_map<std::uint64_t, Entry>::iterator it)
+    {
+        size_ -= it->second.layer->memory;
+        lru_.erase(it->second.position);
+        entries_.erase(it);
+    }
+
+    static bool sameGroups(const std::vector<geometry::PathGroup>& lhs, const std::vector<geometry::PathGroup>& rhs)
+    {
+        return std::equal(
+            lhs.begin(),
+            lhs.end(),
+            rhs.begin(),
+            rhs.end(),
+            [](const geometry::PathGroup& left, const geometry::PathGroup& right)
+            {
+                return left.paths == right.paths && left.bounding_box == right.bounding_box;
+            });
+    }
+
+    /*! Hash of the contour edges whose bounding box overlaps the given box, in the order of the contours */
+    static std::uint64_t edgeDigest(const std::vector<geometry::polygon_outer<>>& contours, const geometry::BoundingBox& bb)
+    {
+        Fnv1a hash;
+        for (std::size_t contour = 0; contour < contours.size(); ++contour)
+        {
+            const auto& points = contours[contour];
+            for (std::size_t i = 0, j = points.size() - 1; i < points.size(); j = i++)
+            {
+                const auto& a = points[j];
+                const auto& b = points[i];
+                const geometry::BoundingBox edge_bb{ { std::min(a.X, b.X), std::min(a.Y, b.Y) }, { std::max(a.X, b.X), std::max(a.Y, b.Y) } };
+                if (geometry::overlaps(edge_bb, bb))
+                {
+                    hash.update(static_cast<std::uint64_t>(contour)).update(a.X).update(a.Y).update(b.X).update(b.Y);
+                }
+            }
+        }
+        return hash.value();
+    }
+
+    /*! The region covered by exactly one of both even-odd outlines */
+    static ClipperLib::Paths difference(const std::vector<geometry::polygon_outer<>>& lhs, const std::vector<geometry::polygon_outer<>>& rhs)
+    {
+        auto& clipper = geometry::threadClipper();
+        for (const auto& contour : lhs)
+        {
+            clipper.AddPath(contour, ClipperLib::PolyType::ptSubject, true);
+        }
+        for (const auto& contour : rhs)
+        {
+            clipper.AddPath(contour, ClipperLib::PolyType::ptClip, true);
+        }
+        ClipperLib::Paths pieces;
+        clipper.Execute(ClipperLib::ClipType::ctXor, pieces);
+        return pieces;
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_INCREMENTAL_CLIP_H
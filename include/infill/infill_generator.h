@@ -4,19 +4,38 @@
 #ifndef INFILL_INFILL_GENERATOR_H
 #define INFILL_INFILL_GENERATOR_H
 
+#include "infill/alloc_profiler.h"
+#include "infill/arena.h"
+#include "infill/cancellation.h"
+#include "infill/embedded_tiles.h"
 #include "infill/geometry.h"
+#include "infill/incremental_clip.h"
+#include "infill/islands.h"
+#include "infill/latency_budget.h"
+#include "infill/path_store.h"
+#include "infill/perf_counters.h"
 #include "infill/point_container.h"
+#include "infill/result_cache.h"
 #include "infill/tile.h"
+#include "infill/tile_cache.h"
+#include "infill/work_pool.h"
+#include <fmt/format.h>
 #include <spdlog/spdlog.h>
 
 #include <polyclipping/clipper.hpp>
 #include <range/v3/algorithm/minmax.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <numbers>
-#include <numeric>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 
 namespace infill
 {
@@ -24,31 +43,57 @@ namespace infill
 class InfillGenerator
 {
 public:
-    std::filesystem::path tiles_path;
+    std::size_t clip_partitions{ 1 };
+    std::shared_ptr<TileCache> tile_cache{ std::make_shared<TileCache>() };
+    std::shared_ptr<ResultCache> result_cache;
+    std::shared_ptr<IncrementalClip> incremental_clip; //!< Reuses the previous layer of a session, disabled when not set
 
-    static std::tuple<std::vector<geometry::polyline<>>, std::vector<geometry::polygon_outer<>>> gridToPolygon(const auto& grid)
+    static constexpr ClipperLib::cInt simplify_tolerance{ 20 }; //!< [µm] well below a line width, barely visible
+    static constexpr ClipperLib::cInt cull_tolerance{ 50 }; //!< [µm]
+    static constexpr ClipperLib::cInt cull_extent{ 1000 }; //!< [µm] paths smaller than this are dropped when culling
+
+    static geometry::path_store<> gridToPolygon(const auto& grid, const CancellationToken& cancellation = {}, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
     {
-        std::tuple<std::vector<geometry::polyline<>>, std::vector<geometry::polygon_outer<>>> shape;
+        geometry::path_store<> shape{ resource };
         for (const auto& row : grid)
         {
             for (const auto& tile : row)
             {
-                auto [lines, polys] = tile.render(false);
-                std::get<0>(shape).insert(std::get<0>(shape).end(), lines.begin(), lines.end());
-                std::get<1>(shape).insert(std::get<1>(shape).end(), polys.begin(), polys.end());
+                cancellation.check();
+                tile.renderInto(shape);
             }
         }
         return shape;
     }
 
-    std::tuple<ClipperLib::Paths, ClipperLib::Paths> generate(
-        const std::vector<geometry::polygon_outer<>>& outer_contours,
-        std::string_view pattern,
+    /*! Clip the content of the layer file, placed at the center and scaled, against the outlines
+     *
+     * The layer file is resolved by the caller with layerFile, so it can read the file ahead on the reader threads while
+     * the call waits for a worker. Layers of several islands are clipped island by island, see geometry::clip.
+     * Consecutive layers of a session on the same tile only re-clip where their outline changed, when incremental
+     * clipping is enabled.
+     *
+     * With a limited budget the cost of parsing and clipping is estimated up front. When the estimate exceeds the time
+     * left, the generator steps down: to the already parsed tile of a nearby layer instead of parsing this one, then to
+     * a simplified and finally a culled tile. The quality it settled on is left in the budget, degraded results are not
+     * written to the result cache.
+     */
+    geometry::path_store<> generate(
+        const std::filesystem::path& content_path,
+        const geometry::Islands& islands,
         const int64_t infill_scale,
         const int64_t center_x,
         const int64_t center_y,
-        const int64_t z)
+        const int64_t z,
+        const CancellationToken& cancellation = {},
+        LatencyBudget* budget = nullptr,
+        std::string_view session = {}) const
     {
+        const AllocStage alloc_stage{ "generate" };
+        cancellation.check();
+        const auto arena = ArenaPool::global().acquire();
+        const auto& outer_contours = islands.contours();
+
         auto bounding_boxes = outer_contours
                             | ranges::views::transform(
                                   [](const auto& contour)
@@ -63,11 +108,127 @@ public:
         // ------------------------------------------------------------
         spdlog::info("Received z: {}", static_cast<int64_t>(z));
 
+        std::optional<ResultCache::Key> cache_key;
+        if (result_cache && (findEmbedded(content_path) != nullptr || std::filesystem::is_regular_file(content_path)))
+        {
+            cache_key = result_cache->key(content_path, outer_contours, infill_scale, center_x, center_y, clip_partitions);
+            if (auto cached = result_cache->get(*cache_key))
+            {
+                spdlog::debug("Served layer {} from the result cache", z);
+                return std::move(*cached);
+            }
+        }
+
+        auto& cost = CostModel::global();
+        const auto limited = budget != nullptr && budget->limited();
+        const auto outline_points = islands.pointCount();
+
+        // A tile that is not cached yet has to be parsed first, its size is only known from the file.
+        auto tile_path = content_path;
+        std::uintmax_t parse_bytes{ 0 };
+        if (tile_cache && ! tile_cache->contains(content_path))
+        {
+            std::error_code error;
+            parse_bytes = std::filesystem::file_size(content_path, error);
+            parse_bytes = error ? 0 : parse_bytes;
+            const auto estimate = cost.parse(parse_bytes) + cost.clip(parse_bytes / CostModel::bytes_per_point, outline_points);
+            if (limited && estimate > budget->remaining())
+            {
+                if (auto nearby = tile_cache->nearestCached(content_path))
+                {
+                    spdlog::debug("Layer {} is estimated to take {} ms, using the parsed tile {} instead", z, estimate.count() / 1000000, nearby->string());
+                    tile_path = std::move(*nearby);
+                    parse_bytes = 0;
+                    budget->degrade(Quality::nearby_layer);
+                }
+            }
+        }
+
         std::vector<std::vector<Tile>> grid;
+        size_t row_count{ 0 };
 
+        std::vector<Tile> row;
+        row.push_back({ .x = center_x, .y = center_y, .filepath = tile_path, .magnitude = infill_scale, .cache = tile_cache });
+        grid.push_back(std::move(row));
+        // Cut the grid with the outer contour using Clipper
+        // All temporary geometry of this request lives in the arena, only the result is allocated on the regular heap.
+        auto content = [&]
+        {
+            const PerfStage perf_stage{ "render" };
+            const auto start = std::chrono::steady_clock::now();
+            auto paths = gridToPolygon(grid, cancellation, arena.resource());
+            cost.recordParse(parse_bytes, std::chrono::steady_clock::now() - start);
+            return paths;
+        }();
+
+        // Step down until the clip fits into the time left, each step is far cheaper than the clip it saves.
+        if (limited && cost.clip(content.points().size(), outline_points) > budget->remaining())
+        {
+            content = geometry::simplify(content, simplify_tolerance, 0, arena.resource());
+            budget->degrade(Quality::simplified);
+            if (cost.clip(content.points().size(), outline_points) > budget->remaining())
+            {
+                content = geometry::simplify(content, cull_tolerance, cull_extent, arena.resource());
+                budget->degrade(Quality::culled);
+            }
+        }
+
+        geometry::path_store<> result;
+        {
+            const PerfStage perf_stage{ "clip" };
+            const auto start = std::chrono::steady_clock::now();
+            // Both clips append straight to the result, which is the only store outliving the arena. A degraded content
+            // differs from the one the previous layer was clipped from, so it is always clipped in full.
+            if (incremental_clip && ! session.empty() && (budget == nullptr || budget->quality == Quality::full))
+            {
+                const auto key = IncrementalClip::key(session, tile_path, infill_scale, center_x, center_y);
+                incremental_clip->clip(key, content, islands, clip_partitions, WorkPool::global(), cancellation, result);
+            }
+            else
+            {
+                geometry::clip(content.polylines(), false, islands, clip_partitions, WorkPool::global(), cancellation, result);
+                geometry::clip(content.polygons(), true, islands, clip_partitions, WorkPool::global(), cancellation, result);
+            }
+            cost.recordClip(content.points().size(), outline_points, std::chrono::steady_clock::now() - start);
+        }
+        if (cache_key.has_value() && (budget == nullptr || budget->quality == Quality::full))
+        {
+            result_cache->put(*cache_key, result);
+        }
+        return result;
+    }
+
+    /*! Position of the infill center on the build plate in µm, from its offset to the center of the build plate in mm */
+    static std::pair<int64_t, int64_t> infillCenter(long double machine_width, long double machine_depth, long double center_x, long double center_y)
+    {
+        return { static_cast<int64_t>(1000.0 * (machine_width / 2.0 + center_x)), static_cast<int64_t>(1000.0 * (machine_depth / 2.0 - center_y)) };
+    }
+
+    /*! The layer file for height z, or the next one above (or the highest one) if there is none for z
+     *
+     * Tile sets compiled into the executable are resolved from their z index, without looking at the directory.
+     */
+    static std::filesystem::path layerFile(const std::filesystem::path& tiles_path, std::string_view pattern, const int64_t z)
+    {
         //path used later in the plugin for the current layer file
         auto content_path = tiles_path;
 
+        if (const auto layers = embeddedLayers(tiles_path, pattern); ! layers.empty())
+        {
+            const auto layer = std::lower_bound(
+                layers.begin(),
+                layers.end(),
+                z,
+                [](const EmbeddedTile& tile, int64_t value)
+                {
+                    return tile.z < value;
+                });
+            const auto layer_z = layer != layers.end() ? layer->z : layers.back().z;
+            content_path += fmt::format("/{}_{}.wkt", layer_z, pattern);
+            spdlog::info("Embedded file used for layer {}: {}", z, content_path.filename().string());
+            return content_path;
+        }
+
         if (std::filesystem::is_directory(tiles_path)) { //if the given directory exists
             if (!std::filesystem::is_empty(tiles_path)) { //if the given directory is empty
                 auto layer_name = "/" + std::to_string(z) + "_";
@@ -119,14 +280,7 @@ public:
             spdlog::error("The given directory does not exist. Slicing failed");
         }
 
-        size_t row_count{ 0 };
-
-        std::vector<Tile> row;
-        row.push_back({ .x = center_x, .y = center_y, .filepath = content_path, .magnitude = infill_scale });
-        grid.push_back(row);
-        // Cut the grid with the outer contour using Clipper
-        auto [lines, polys] = gridToPolygon(grid);
-        return { geometry::clip(lines, false, outer_contours), geometry::clip(polys, true, outer_contours) };
+        return content_path;
     }
 };
 
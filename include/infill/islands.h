@@ -0,0 +1,187 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_ISLANDS_H
+#define INFILL_ISLANDS_H
+
+#include "infill/point_container.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <span>
+#include <vector>
+
+namespace infill::geometry
+{
+
+/*! The outlines of a layer grouped into islands, each an outer contour followed by the holes inside it
+ *
+ * All contours are kept in one vector in the order they were added, so code that does not care about the islands can
+ * treat them as the flat even-odd set the engine sends.
+ */
+class Islands
+{
+public:
+    Islands() = default;
+
+    /*! Start a new island, the returned contour is filled in place */
+    polygon_outer<>& addOutline()
+    {
+        starts_.push_back(contours_.size());
+        return contours_.emplace_back();
+    }
+
+    /*! Add a hole to the island started last */
+    polygon_outer<>& addHole()
+    {
+        if (starts_.empty())
+        {
+            starts_.push_back(0);
+        }
+        return contours_.emplace_back();
+    }
+
+    /*! Recover the islands of contours given without their hierarchy
+     *
+     * A contour lying inside an odd number of others is a hole of the smallest contour around it, all others start
+     * an island, including parts lying in the hole of another part. Contours already ordered as outline followed by
+     * its holes keep their order.
+     */
+    static Islands fromContours(const std::vector<polygon_outer<>>& contours)
+    {
+        const auto count = contours.size();
+        std::vector<double> areas(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            areas[i] = std::abs(area(contours[i]));
+        }
+
+        std::vector<std::size_t> parent(count, count);
+        std::vector<std::size_t> depth(count, 0);
+        std::vector<std::size_t> by_area(count);
+        std::iota(by_area.begin(), by_area.end(), 0);
+        std::stable_sort(
+            by_area.begin(),
+            by_area.end(),
+            [&areas](std::size_t lhs, std::size_t rhs)
+            {
+                return areas[lhs] > areas[rhs];
+            });
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const auto contour = by_area[i];
+            if (contours[contour].empty())
+            {
+                continue;
+            }
+            // The smallest larger contour around it is the last one containing it in order of decreasing area.
+            for (std::size_t j = i; j-- > 0;)
+            {
+                const auto candidate = by_area[j];
+                if (contains(contours[candidate], contours[contour].front()))
+                {
+                    parent[contour] = candidate;
+                    depth[contour] = depth[candidate] + 1;
+                    break;
+                }
+            }
+        }
+
+        Islands islands;
+        for (std::size_t outline = 0; outline < count; ++outline)
+        {
+            if (depth[outline] % 2 != 0)
+            {
+                continue;
+            }
+            islands.addOutline() = contours[outline];
+            for (std::size_t hole = 0; hole < count; ++hole)
+            {
+                if (parent[hole] == outline && depth[hole] % 2 != 0)
+                {
+                    islands.addHole() = contours[hole];
+                }
+            }
+        }
+        return islands;
+    }
+
+    [[nodiscard]] const std::vector<polygon_outer<>>& contours() const noexcept
+    {
+        return contours_;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return starts_.size();
+    }
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return starts_.empty();
+    }
+
+    /*! The outer contour of the island followed by its holes */
+    [[nodiscard]] std::span<const polygon_outer<>> island(std::size_t index) const noexcept
+    {
+        const auto end = index + 1 < starts_.size() ? starts_[index + 1] : contours_.size();
+        return std::span<const polygon_outer<>>{ contours_ }.subspan(starts_[index], end - starts_[index]);
+    }
+
+    [[nodiscard]] std::size_t pointCount() const noexcept
+    {
+        return std::accumulate(
+            contours_.begin(),
+            contours_.end(),
+            std::size_t{ 0 },
+            [](std::size_t sum, const auto& contour)
+            {
+                return sum + contour.size();
+            });
+    }
+
+private:
+    std::vector<polygon_outer<>> contours_;
+    std::vector<std::size_t> starts_; //!< Index of the outer contour of every island in contours_
+
+    static double area(const polygon_outer<>& contour) noexcept
+    {
+        if (contour.empty())
+        {
+            return 0.0;
+        }
+        double twice_area{ 0 };
+        for (std::size_t i = 0, j = contour.size() - 1; i < contour.size(); j = i++)
+        {
+            twice_area += static_cast<double>(contour[j].X) * static_cast<double>(contour[i].Y) - static_cast<double>(contour[i].X) * static_cast<double>(contour[j].Y);
+        }
+        return twice_area / 2.0;
+    }
+
+    /*! Even-odd ray casting, points on the contour may fall to either side */
+    static bool contains(const polygon_outer<>& contour, const Point& point) noexcept
+    {
+        if (contour.empty())
+        {
+            return false;
+        }
+        bool inside{ false };
+        for (std::size_t i = 0, j = contour.size() - 1; i < contour.size(); j = i++)
+        {
+            const auto& a = contour[i];
+            const auto& b = contour[j];
+            if ((a.Y > point.Y) != (b.Y > point.Y)
+                && static_cast<double>(point.X) < static_cast<double>(b.X - a.X) * static_cast<double>(point.Y - a.Y) / static_cast<double>(b.Y - a.Y) + static_cast<double>(a.X))
+            {
+                inside = ! inside;
+            }
+        }
+        return inside;
+    }
+};
+
+} // namespace infill::geometry
+
+#endif // INFILL_ISLANDS_H
@@ -0,0 +1,176 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_LATENCY_BUDGET_H
+#define INFILL_LATENCY_BUDGET_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace infill
+{
+
+/*! How a generated layer was reduced to stay within its latency budget, a set of flags
+ *
+ * The simplification and the substitution of the tile are independent: a layer may be served from the tile of a nearby
+ * layer and still be simplified. Of the simplifications only the coarsest one applied is set.
+ */
+enum class Quality : std::uint8_t
+{
+    full = 0,
+    simplified = 1 << 0, //!< Points closer than a fraction of a line width to their predecessor are dropped
+    culled = 1 << 1, //!< Coarser simplification, and paths smaller than about two line widths are dropped
+    nearby_layer = 1 << 2, //!< The tile of a nearby layer that was already parsed was used instead of the one of this layer
+};
+
+/*! Every reduction on its own, in the order they are reported */
+inline constexpr std::array degradations{ Quality::simplified, Quality::culled, Quality::nearby_layer };
+
+constexpr Quality operator|(Quality lhs, Quality rhs) noexcept
+{
+    return static_cast<Quality>(static_cast<std::uint8_t>(lhs) | static_cast<std::uint8_t>(rhs));
+}
+
+/*! Whether the quality includes any of the reductions */
+constexpr bool includes(Quality quality, Quality reductions) noexcept
+{
+    return (static_cast<std::uint8_t>(quality) & static_cast<std::uint8_t>(reductions)) != 0;
+}
+
+constexpr std::string_view qualityName(Quality quality) noexcept
+{
+    switch (quality)
+    {
+    case Quality::full:
+        return "full";
+    case Quality::simplified:
+        return "simplified";
+    case Quality::culled:
+        return "culled";
+    case Quality::nearby_layer:
+        return "nearby layer";
+    }
+    return "unknown";
+}
+
+/*! The names of all reductions of the quality, "full" without any */
+inline std::string qualityNames(Quality quality)
+{
+    std::string names;
+    for (const auto degradation : degradations)
+    {
+        if (includes(quality, degradation))
+        {
+            names += names.empty() ? "" : ", ";
+            names += qualityName(degradation);
+        }
+    }
+    return names.empty() ? std::string{ qualityName(Quality::full) } : names;
+}
+
+/*! The time a request may take, and the quality the generator had to fall back to in order to stay within it */
+struct LatencyBudget
+{
+    using clock_t = std::chrono::steady_clock;
+
+    clock_t::time_point deadline{ clock_t::time_point::max() };
+    Quality quality{ Quality::full };
+
+    [[nodiscard]] bool limited() const noexcept
+    {
+        return deadline != clock_t::time_point::max();
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds remaining() const noexcept
+    {
+        return limited() ? std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - clock_t::now()) : std::chrono::nanoseconds::max();
+    }
+
+    /*! Add a reduction, culling replaces a simplification */
+    void degrade(Quality to) noexcept
+    {
+        quality = quality | to;
+        if (includes(quality, Quality::culled))
+        {
+            quality = static_cast<Quality>(static_cast<std::uint8_t>(quality) & ~static_cast<std::uint8_t>(Quality::simplified));
+        }
+    }
+};
+
+/*! Estimates how long parsing a tile file and clipping a layer take, learned from the requests served so far
+ *
+ * Parsing is linear in the size of the file. Clipping is a sweep over the edges of the tile content and the outlines,
+ * so it is taken to grow with n log n of all points. Both rates are moving averages over the measured stages and start
+ * from conservative guesses, so the first requests rather degrade too early than too late.
+ */
+class CostModel
+{
+public:
+    static constexpr std::size_t bytes_per_point{ 16 }; //!< Rough size of one point in a WKT file, "-12345 67890, "
+
+    static CostModel& global()
+    {
+        static CostModel model;
+        return model;
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds parse(std::uintmax_t bytes) const noexcept
+    {
+        return nanoseconds(ns_per_byte_.load(std::memory_order_relaxed) * static_cast<double>(bytes));
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds clip(std::size_t content_points, std::size_t outline_points) const noexcept
+    {
+        return nanoseconds(ns_per_clip_unit_.load(std::memory_order_relaxed) * clipUnits(content_points, outline_points));
+    }
+
+    void recordParse(std::uintmax_t bytes, std::chrono::nanoseconds duration) noexcept
+    {
+        if (bytes > 0)
+        {
+            update(ns_per_byte_, static_cast<double>(duration.count()) / static_cast<double>(bytes));
+        }
+    }
+
+    void recordClip(std::size_t content_points, std::size_t outline_points, std::chrono::nanoseconds duration) noexcept
+    {
+        if (content_points > 0)
+        {
+            update(ns_per_clip_unit_, static_cast<double>(duration.count()) / clipUnits(content_points, outline_points));
+        }
+    }
+
+private:
+    std::atomic<double> ns_per_byte_{ 20.0 };
+    std::atomic<double> ns_per_clip_unit_{ 50.0 };
+
+    static double clipUnits(std::size_t content_points, std::size_t outline_points) noexcept
+    {
+        const auto points = static_cast<double>(content_points + outline_points);
+        return points * std::log2(points + 2.0);
+    }
+
+    static std::chrono::nanoseconds nanoseconds(double ns) noexcept
+    {
+        return std::chrono::nanoseconds{ static_cast<std::int64_t>(std::min(ns, 1e18)) };
+    }
+
+    static void update(std::atomic<double>& rate, double sample) noexcept
+    {
+        auto current = rate.load(std::memory_order_relaxed);
+        while (! rate.compare_exchange_weak(current, current * 0.8 + sample * 0.2, std::memory_order_relaxed))
+        {
+        }
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_LATENCY_BUDGET_H
@@ -0,0 +1,484 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_MEMORY_GOVERNOR_H
+#define INFILL_MEMORY_GOVERNOR_H
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if __has_include(<poll.h>) && __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#define INFILL_HAS_PSI
+#endif
+
+#if __has_include(<malloc.h>) && defined(__GLIBC__)
+#include <malloc.h>
+#define INFILL_HAS_MALLOC_TRIM
+#endif
+
+namespace infill
+{
+
+/*! The memory limit and usage of the cgroup v2 the process runs in */
+class CgroupMemory
+{
+public:
+    /*! The cgroup of the process, if it is in a cgroup v2 hierarchy with the memory controller enabled */
+    static std::optional<CgroupMemory> detect()
+    {
+        std::ifstream cgroups{ "/proc/self/cgroup" };
+        std::string line;
+        while (std::getline(cgroups, line))
+        {
+            if (! line.starts_with("0::"))
+            {
+                continue;
+            }
+            // Inside a cgroup namespace the own cgroup is mounted as the root, its path then does not exist below it.
+            for (const auto& directory : { std::filesystem::path{ "/sys/fs/cgroup" + line.substr(3) }, std::filesystem::path{ "/sys/fs/cgroup" } })
+            {
+                std::error_code error;
+                if (std::filesystem::exists(directory / "memory.current", error))
+                {
+                    return CgroupMemory{ directory };
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    [[nodiscard]] const std::filesystem::path& directory() const noexcept
+    {
+        return directory_;
+    }
+
+    /*! memory.max, or nothing when the cgroup is not limited */
+    [[nodiscard]] std::optional<std::size_t> limit() const
+    {
+        return read("memory.max");
+    }
+
+    [[nodiscard]] std::optional<std::size_t> current() const
+    {
+        return read("memory.current");
+    }
+
+    /*! memory.current without the inactive page cache, which the kernel reclaims before it runs out of memory
+     *
+     * This is the working set the OOM killer acts on, like container runtimes measure it. Files the process read
+     * recently stay charged to the cgroup as page cache and would otherwise make the caches shrink for nothing.
+     */
+    [[nodiscard]] std::optional<std::size_t> workingSet() const
+    {
+        const auto usage = current();
+        if (! usage.has_value())
+        {
+            return std::nullopt;
+        }
+        const auto inactive_file = stat("inactive_file").value_or(0);
+        return *usage > inactive_file ? *usage - inactive_file : 0;
+    }
+
+private:
+    std::filesystem::path directory_;
+
+    /*! A counter of memory.stat in bytes */
+    [[nodiscard]] std::optional<std::size_t> stat(std::string_view key) const
+    {
+        std::ifstream file{ directory_ / "memory.stat" };
+        std::string name;
+        std::size_t value{ 0 };
+        while (file >> name >> value)
+        {
+            if (name == key)
+            {
+                return value;
+            }
+        }
+        return std::nullopt;
+    }
+
+    explicit CgroupMemory(std::filesystem::path directory)
+        : directory_{ std::move(directory) }
+    {
+    }
+
+    [[nodiscard]] std::optional<std::size_t> read(const char* name) const
+    {
+        std::ifstream file{ directory_ / name };
+        std::string text;
+        if (! (file >> text))
+        {
+            return std::nullopt;
+        }
+        std::size_t value{ 0 };
+        if (std::from_chars(text.data(), text.data() + text.size(), value).ptr != text.data() + text.size())
+        {
+            return std::nullopt; // "max"
+        }
+        return value;
+    }
+};
+
+/*! Keeps the memory of all caches of the process within one budget
+ *
+ * Caches register how to measure and how to shrink themselves, together with a priority. The caches are kept below
+ * the budget given on start, or half of the cgroup memory limit without one. Independently, when the working set of
+ * the cgroup gets close to its limit or the kernel reports memory pressure (PSI) for it, the caches release memory
+ * before the OOM killer has to step in. Caches of lower priority are shrunk first. The limits of the caches themselves still apply.
+ *
+ * The governor runs on its own thread and calls the caches from there, so a cache must never call into the governor
+ * while holding its own lock.
+ */
+class MemoryGovernor
+{
+public:
+    /*! Order in which caches are shrunk, the lowest first */
+    enum class Priority
+    {
+        scratch, //!< Buffers kept for reuse, reallocated on demand
+        derived, //!< Results that are cheap to compute again
+        parsed, //!< Content that has to be read and parsed again
+    };
+
+    static constexpr std::size_t high_watermark_percent{ 85 }; //!< Of the cgroup limit, above it in working set the caches shrink
+    static constexpr std::chrono::milliseconds interval{ 1000 };
+
+    /*! Unregisters its cache when destroyed, waiting for a shrink of that cache in progress */
+    class Registration
+    {
+    public:
+        Registration() = default;
+
+        Registration(MemoryGovernor* governor, std::size_t id) noexcept
+            : governor_{ governor }
+            , id_{ id }
+        {
+        }
+
+        Registration(Registration&& other) noexcept
+            : governor_{ std::exchange(other.governor_, nullptr) }
+            , id_{ other.id_ }
+        {
+        }
+
+        Registration& operator=(Registration&& other) noexcept
+        {
+            reset();
+            governor_ = std::exchange(other.governor_, nullptr);
+            id_ = other.id_;
+            return *this;
+        }
+
+        Registration(const Registration&) = delete;
+        Registration& operator=(const Registration&) = delete;
+
+        ~Registration()
+        {
+            reset();
+        }
+
+    private:
+        MemoryGovernor* governor_{ nullptr };
+        std::size_t id_{ 0 };
+
+        void reset()
+        {
+            if (governor_ != nullptr)
+            {
+                std::exchange(governor_, nullptr)->remove(id_);
+            }
+        }
+    };
+
+    /*! The process wide governor, it only acts once started */
+    static MemoryGovernor& global()
+    {
+        static MemoryGovernor governor;
+        return governor;
+    }
+
+    MemoryGovernor() = default;
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    ~MemoryGovernor()
+    {
+        stop();
+    }
+
+    /*! Register a cache, usage returns its memory in bytes and shrink(bytes) releases at least that much if it can
+     * and returns how much it released
+     */
+    [[nodiscard]] Registration add(std::string name, Priority priority, std::function<std::size_t()> usage, std::function<std::size_t(std::size_t)> shrink)
+    {
+        std::scoped_lock lock{ mutex_ };
+        caches_.push_back({ .id = next_id_, .name = std::move(name), .priority = priority, .usage = std::move(usage), .shrink = std::move(shrink) });
+        return { this, next_id_++ };
+    }
+
+    /*! Start watching, with a budget in bytes for all caches together, 0 derives it from the cgroup limit */
+    void start(std::size_t budget = 0)
+    {
+        stop();
+        std::scoped_lock lock{ mutex_ };
+        cgroup_ = CgroupMemory::detect();
+        const auto limit = cgroup_.has_value() ? cgroup_->limit() : std::nullopt;
+        budget_ = budget > 0 ? budget : limit.value_or(0) / 2;
+        if (limit.has_value())
+        {
+            spdlog::info("Memory limit of the cgroup is {} MiB, caches may use {} MiB", *limit >> 20, budget_ >> 20);
+        }
+        else
+        {
+            spdlog::info("No cgroup memory limit found, caches may use {}", budget_ > 0 ? fmt::format("{} MiB", budget_ >> 20) : "their own limits");
+        }
+#ifdef INFILL_HAS_PSI
+        if (::pipe(wake_) != 0)
+        {
+            wake_[0] = wake_[1] = -1;
+        }
+#endif
+        stopped_ = false;
+        thread_ = std::thread{ [this]
+                               {
+                                   watch();
+                               } };
+    }
+
+    void stop()
+    {
+        if (! thread_.joinable())
+        {
+            return;
+        }
+        {
+            std::scoped_lock lock{ mutex_ };
+            stopped_ = true;
+        }
+        stopped_changed_.notify_all();
+#ifdef INFILL_HAS_PSI
+        if (wake_[1] >= 0)
+        {
+            [[maybe_unused]] const auto written = ::write(wake_[1], "x", 1);
+        }
+#endif
+        thread_.join();
+#ifdef INFILL_HAS_PSI
+        for (auto& fd : wake_)
+        {
+            if (fd >= 0)
+            {
+                ::close(std::exchange(fd, -1));
+            }
+        }
+#endif
+    }
+
+    /*! Bring the caches back within their limits, under pressure they give up half of their memory as well
+     *
+     * Returns the number of bytes released.
+     */
+    std::size_t enforce(bool pressure = false)
+    {
+        std::scoped_lock lock{ mutex_ };
+        std::size_t total{ 0 };
+        for (const auto& cache : caches_)
+        {
+            total += cache.usage();
+        }
+
+        auto target = total;
+        if (budget_ > 0)
+        {
+            target = std::min(target, budget_);
+        }
+        if (cgroup_.has_value())
+        {
+            const auto limit = cgroup_->limit();
+            const auto current = cgroup_->workingSet();
+            if (limit.has_value() && current.has_value() && *current > *limit / 100 * high_watermark_percent)
+            {
+                const auto excess = *current - *limit / 100 * high_watermark_percent;
+                target = std::min(target, total > excess ? total - excess : 0);
+            }
+        }
+        if (pressure)
+        {
+            target = std::min(target, total / 2);
+        }
+        if (target >= total)
+        {
+            return 0;
+        }
+
+        std::vector<Cache*> order;
+        for (auto& cache : caches_)
+        {
+            order.push_back(&cache);
+        }
+        std::stable_sort(
+            order.begin(),
+            order.end(),
+            [](const Cache* lhs, const Cache* rhs)
+            {
+                return lhs->priority < rhs->priority;
+            });
+        const auto wanted = total - target;
+        std::size_t released{ 0 };
+        for (auto* cache : order)
+        {
+            if (released >= wanted)
+            {
+                break;
+            }
+            const auto freed = cache->shrink(wanted - released);
+            spdlog::debug("Released {} KiB of the {}", freed >> 10, cache->name);
+            released += freed;
+        }
+#ifdef INFILL_HAS_MALLOC_TRIM
+        // Freed cache entries mostly return to the heap of the allocator, hand them back to the system.
+        ::malloc_trim(0);
+#endif
+        spdlog::info("Released {} MiB of {} MiB held by caches{}", released >> 20, total >> 20, pressure ? " under memory pressure" : "");
+        return released;
+    }
+
+private:
+    struct Cache
+    {
+        std::size_t id;
+        std::string name;
+        Priority priority;
+        std::function<std::size_t()> usage;
+        std::function<std::size_t(std::size_t)> shrink;
+    };
+
+    std::mutex mutex_;
+    std::vector<Cache> caches_;
+    std::size_t next_id_{ 0 };
+    std::optional<CgroupMemory> cgroup_;
+    std::size_t budget_{ 0 };
+    bool stopped_{ true };
+    std::condition_variable stopped_changed_;
+    std::thread thread_;
+#ifdef INFILL_HAS_PSI
+    int wake_[2]{ -1, -1 }; //!< Pipe waking the watcher from poll when stopped
+#endif
+
+    void remove(std::size_t id)
+    {
+        std::scoped_lock lock{ mutex_ };
+        std::erase_if(
+            caches_,
+            [id](const Cache& cache)
+            {
+                return cache.id == id;
+            });
+    }
+
+    /*! A PSI trigger on the cgroup, firing when tasks stalled on memory for 150 ms within 2 s, or -1 */
+    [[nodiscard]] int pressureTrigger() const
+    {
+#ifdef INFILL_HAS_PSI
+        if (! cgroup_.has_value())
+        {
+            return -1;
+        }
+        const auto path = cgroup_->directory() / "memory.pressure";
+        const auto fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+        {
+            spdlog::debug("Memory pressure of the cgroup is not available, polling its usage only");
+            return -1;
+        }
+        // Unprivileged triggers need a window of a multiple of 2 s.
+        constexpr std::string_view trigger{ "some 150000 2000000" };
+        if (::write(fd, trigger.data(), trigger.size() + 1) < 0)
+        {
+            spdlog::debug("Could not register a memory pressure trigger, polling the cgroup usage only");
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+#else
+        return -1;
+#endif
+    }
+
+    void watch()
+    {
+        auto trigger = pressureTrigger();
+        while (true)
+        {
+            const auto pressure = waitForPressure(trigger);
+            {
+                std::scoped_lock lock{ mutex_ };
+                if (stopped_)
+                {
+                    break;
+                }
+            }
+            enforce(pressure);
+        }
+#ifdef INFILL_HAS_PSI
+        if (trigger >= 0)
+        {
+            ::close(trigger);
+        }
+#endif
+    }
+
+    /*! Wait for one interval, or until the pressure trigger fires or the governor is stopped, returns whether it fired */
+    bool waitForPressure(int& trigger)
+    {
+#ifdef INFILL_HAS_PSI
+        pollfd fds[2]{ { .fd = wake_[0], .events = POLLIN, .revents = 0 }, { .fd = trigger, .events = POLLPRI, .revents = 0 } };
+        if (::poll(fds, 2, static_cast<int>(interval.count())) <= 0)
+        {
+            return false;
+        }
+        if ((fds[1].revents & POLLERR) != 0)
+        {
+            spdlog::warn("The memory pressure trigger was removed, polling the cgroup usage only");
+            ::close(std::exchange(trigger, -1));
+            return false;
+        }
+        return (fds[1].revents & POLLPRI) != 0;
+#else
+        std::unique_lock lock{ mutex_ };
+        stopped_changed_.wait_for(
+            lock,
+            interval,
+            [this]
+            {
+                return stopped_;
+            });
+        return false;
+#endif
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_MEMORY_GOVERNOR_H
@@ -0,0 +1,123 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_PATH_ORDER_H
+#define INFILL_PATH_ORDER_H
+
+#include "infill/geometry.h"
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ranges>
+#include <utility>
+#include <vector>
+
+namespace infill::geometry
+{
+
+/*! Position of a point on a Hilbert curve filling a grid of 2^16 x 2^16 cells */
+constexpr std::uint64_t hilbertIndex(std::uint32_t x, std::uint32_t y) noexcept
+{
+    constexpr std::uint32_t n{ 1u << 16 };
+    std::uint64_t index{ 0 };
+    for (std::uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        const std::uint32_t rx = (x & s) > 0 ? 1 : 0;
+        const std::uint32_t ry = (y & s) > 0 ? 1 : 0;
+        index += std::uint64_t{ s } * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+/*! Sort the paths along a Hilbert curve and orient the open paths so each one starts where the previous one ended
+ *
+ * Polygons are keyed by the center of their bounding box, open paths by the midpoint of their ends, which does not
+ * depend on their direction. Neighbouring paths in the result are close to each other, which saves CuraEngine most of
+ * its nearest neighbour search when it orders the infill and gives shorter travel moves. Discarded paths are dropped.
+ */
+static path_store<> orderPaths(const path_store<>& paths)
+{
+    if (paths.empty())
+    {
+        return paths;
+    }
+
+    const auto bounding_box = computeBoundingBox(paths.points());
+    const auto width = std::max<ClipperLib::cInt>(bounding_box.back().X - bounding_box.front().X, 1);
+    const auto height = std::max<ClipperLib::cInt>(bounding_box.back().Y - bounding_box.front().Y, 1);
+    const auto cell = [&](const Point& point)
+    {
+        // Map the content onto the curve grid, dividing in floating point to not overflow large coordinates.
+        const auto x = static_cast<double>(point.X - bounding_box.front().X) / static_cast<double>(width);
+        const auto y = static_cast<double>(point.Y - bounding_box.front().Y) / static_cast<double>(height);
+        return hilbertIndex(static_cast<std::uint32_t>(x * 65535.0), static_cast<std::uint32_t>(y * 65535.0));
+    };
+
+    std::vector<std::pair<std::uint64_t, std::size_t>> polylines;
+    std::vector<std::pair<std::uint64_t, std::size_t>> polygons;
+    for (std::size_t index = 0; index < paths.size(); ++index)
+    {
+        const auto path = paths.path(index);
+        if (path.empty())
+        {
+            continue;
+        }
+        if (paths.kind(index) == path_kind::polyline)
+        {
+            polylines.emplace_back(cell({ (path.front().X + path.back().X) / 2, (path.front().Y + path.back().Y) / 2 }), index);
+        }
+        else if (paths.kind(index) == path_kind::polygon)
+        {
+            const auto bb = computeBoundingBox(path);
+            polygons.emplace_back(cell({ (bb.front().X + bb.back().X) / 2, (bb.front().Y + bb.back().Y) / 2 }), index);
+        }
+    }
+    std::sort(polylines.begin(), polylines.end());
+    std::sort(polygons.begin(), polygons.end());
+
+    path_store<> ret{ paths.get_allocator() };
+    ret.reserve(polylines.size() + polygons.size(), paths.points().size());
+    const auto distance = [](const Point& lhs, const Point& rhs)
+    {
+        const auto dx = static_cast<double>(lhs.X - rhs.X);
+        const auto dy = static_cast<double>(lhs.Y - rhs.Y);
+        return dx * dx + dy * dy;
+    };
+    std::optional<Point> last;
+    for (const auto& [key, index] : polylines)
+    {
+        const auto path = paths.path(index);
+        if (last.has_value() && distance(*last, path.back()) < distance(*last, path.front()))
+        {
+            ret.push_back(path_kind::polyline, std::views::reverse(path));
+            last = path.front();
+        }
+        else
+        {
+            ret.push_back(path_kind::polyline, path);
+            last = path.back();
+        }
+    }
+    for (const auto& [key, index] : polygons)
+    {
+        ret.push_back(path_kind::polygon, paths.path(index));
+    }
+    return ret;
+}
+
+} // namespace infill::geometry
+
+#endif // INFILL_PATH_ORDER_H
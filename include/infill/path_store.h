@@ -0,0 +1,369 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_PATH_STORE_H
+#define INFILL_PATH_STORE_H
+
+#include "infill/concepts.h"
+#include "infill/point_container.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+namespace infill::geometry
+{
+
+enum class path_kind : std::uint8_t
+{
+    polyline,
+    polygon,
+    discarded
+};
+
+/*! A non-owning view on a single path stored in a path_store
+ *
+ * Carries the same compile time tags as point_container, so a view satisfies concepts::polyline or concepts::polygon
+ * just like the owning containers do.
+ *
+ * @tparam P
+ * @tparam IsClosed
+ * @tparam Direction
+ */
+template<concepts::point P, bool IsClosed, direction Direction>
+struct point_span : public std::span<P>
+{
+    inline static constexpr bool is_closed = IsClosed;
+    inline static constexpr direction winding = Direction;
+
+    constexpr point_span() noexcept = default;
+    constexpr point_span(P* first, std::size_t count) noexcept
+        : std::span<P>(first, count)
+    {
+    }
+};
+
+template<concepts::point P = Point>
+using polyline_view = point_span<P, false, direction::NA>;
+
+template<concepts::point P = Point>
+using polygon_outer_view = point_span<P, true, direction::CW>;
+
+static_assert(concepts::polyline<polyline_view<>>);
+static_assert(concepts::polygon<polygon_outer_view<>>);
+
+/*! A non-owning view on the flat buffers of a path_store, which may also live in memory the store does not own
+ *
+ * @tparam P
+ */
+template<concepts::point2d P = Point>
+struct path_store_view
+{
+    std::span<const P> points;
+    std::span<const std::size_t> offsets;
+    std::span<const path_kind> kinds;
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return kinds.size();
+    }
+};
+
+/*! Flat storage for a set of polylines and polygons
+ *
+ * All points live in one contiguous buffer, path i spans [offsets[i], offsets[i + 1]) and is tagged with a path_kind.
+ * This keeps a tile with many segments down to three allocations and lets transforms run over a single buffer.
+ * Removing a path is done by retagging it as path_kind::discarded, which keeps the buffer untouched. A store without
+ * paths may leave its offsets empty instead of holding the leading 0, so clearing and moving never allocate.
+ * The buffers are allocator aware, so temporary stores can live in a per request arena.
+ *
+ * @tparam P
+ */
+template<concepts::point2d P = Point>
+class path_store
+{
+public:
+    using point_type = P;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    path_store() = default;
+
+    explicit path_store(const allocator_type& allocator)
+        : points_(allocator)
+        , offsets_(allocator)
+        , kinds_(allocator)
+    {
+    }
+
+    path_store(const path_store& other, const allocator_type& allocator)
+        : points_(other.points_, allocator)
+        , offsets_(other.offsets_, allocator)
+        , kinds_(other.kinds_, allocator)
+    {
+    }
+
+    path_store(path_store&& other, const allocator_type& allocator)
+        : points_(std::move(other.points_), allocator)
+        , offsets_(std::move(other.offsets_), allocator)
+        , kinds_(std::move(other.kinds_), allocator)
+    {
+        other.clear();
+    }
+
+    path_store(const path_store&) = default;
+    path_store& operator=(const path_store&) = default;
+
+    // A moved-from vector is empty, which leaves the moved-from store without paths.
+    path_store(path_store&& other) noexcept
+        : points_(std::move(other.points_))
+        , offsets_(std::move(other.offsets_))
+        , kinds_(std::move(other.kinds_))
+    {
+        other.clear();
+    }
+
+    // Between stores of different memory resources the vectors copy the paths, which only fails when the memory is
+    // exhausted, as any other allocation of the plugin would.
+    path_store& operator=(path_store&& other) noexcept
+    {
+        if (this != &other)
+        {
+            points_ = std::move(other.points_);
+            offsets_ = std::move(other.offsets_);
+            kinds_ = std::move(other.kinds_);
+            other.clear();
+        }
+        return *this;
+    }
+
+    [[nodiscard]] allocator_type get_allocator() const noexcept
+    {
+        return points_.get_allocator();
+    }
+
+    void reserve(std::size_t path_count, std::size_t point_count)
+    {
+        offsets_.reserve(path_count + 1);
+        kinds_.reserve(path_count);
+        points_.reserve(point_count);
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return kinds_.size();
+    }
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return kinds_.empty();
+    }
+
+    void clear() noexcept
+    {
+        points_.clear();
+        offsets_.clear();
+        kinds_.clear();
+    }
+
+    void push_back(path_kind kind, const auto& path)
+    {
+        leadingOffset();
+        for (const auto& point : path)
+        {
+            points_.push_back({ point.X, point.Y });
+        }
+        offsets_.push_back(points_.size());
+        kinds_.push_back(kind);
+    }
+
+    void append(const path_store& other)
+    {
+        if (other.empty())
+        {
+            return;
+        }
+        leadingOffset();
+        const auto base = points_.size();
+        points_.insert(points_.end(), other.points_.begin(), other.points_.end());
+        for (auto offset : std::span{ other.offsets_ }.subspan(1))
+        {
+            offsets_.push_back(base + offset);
+        }
+        kinds_.insert(kinds_.end(), other.kinds_.begin(), other.kinds_.end());
+    }
+
+    /*! Append all paths of a store with another point type, converting every point with the given function */
+    template<class Q, class F>
+    void append(const path_store_view<Q>& other, F&& convert)
+    {
+        if (other.size() == 0)
+        {
+            return;
+        }
+        leadingOffset();
+        const auto base = points_.size();
+        points_.reserve(base + other.points.size());
+        for (const auto& point : other.points)
+        {
+            points_.push_back(convert(point));
+        }
+        for (auto offset : other.offsets.subspan(1))
+        {
+            offsets_.push_back(base + offset);
+        }
+        kinds_.insert(kinds_.end(), other.kinds.begin(), other.kinds.end());
+    }
+
+    [[nodiscard]] path_store_view<P> view() const noexcept
+    {
+        const auto offsets = offsets_.empty() ? std::span<const std::size_t>{ no_offsets } : std::span<const std::size_t>{ offsets_ };
+        return { .points = points_, .offsets = offsets, .kinds = kinds_ };
+    }
+
+    [[nodiscard]] std::size_t memoryUsage() const noexcept
+    {
+        return points_.capacity() * sizeof(P) + offsets_.capacity() * sizeof(std::size_t) + kinds_.capacity() * sizeof(path_kind);
+    }
+
+    void discard(std::size_t index) noexcept
+    {
+        kinds_[index] = path_kind::discarded;
+    }
+
+    [[nodiscard]] path_kind kind(std::size_t index) const noexcept
+    {
+        return kinds_[index];
+    }
+
+    /*! All points of all paths, including discarded ones, in storage order */
+    [[nodiscard]] std::span<P> points() noexcept
+    {
+        return points_;
+    }
+
+    [[nodiscard]] std::span<const P> points() const noexcept
+    {
+        return points_;
+    }
+
+    [[nodiscard]] std::span<const P> path(std::size_t index) const noexcept
+    {
+        return std::span<const P>{ points_ }.subspan(offsets_[index], offsets_[index + 1] - offsets_[index]);
+    }
+
+    [[nodiscard]] auto polylines() const
+    {
+        return views<polyline_view<const P>>(path_kind::polyline);
+    }
+
+    [[nodiscard]] auto polygons() const
+    {
+        return views<polygon_outer_view<const P>>(path_kind::polygon);
+    }
+
+private:
+    std::pmr::vector<P> points_;
+    std::pmr::vector<std::size_t> offsets_;
+    std::pmr::vector<path_kind> kinds_;
+
+    inline static constexpr std::size_t no_offsets[]{ 0 }; //!< Offsets of a store without paths for its views
+
+    void leadingOffset()
+    {
+        if (offsets_.empty())
+        {
+            offsets_.push_back(0);
+        }
+    }
+
+    template<class View>
+    class kind_range
+    {
+    public:
+        class iterator
+        {
+        public:
+            using value_type = View;
+            using difference_type = std::ptrdiff_t;
+
+            iterator() = default;
+            iterator(const path_store* store, std::size_t index, path_kind kind) noexcept
+                : store_{ store }
+                , index_{ index }
+                , kind_{ kind }
+            {
+                skip();
+            }
+
+            View operator*() const noexcept
+            {
+                const auto path = store_->path(index_);
+                return View{ path.data(), path.size() };
+            }
+
+            iterator& operator++() noexcept
+            {
+                ++index_;
+                skip();
+                return *this;
+            }
+
+            iterator operator++(int) noexcept
+            {
+                auto previous = *this;
+                ++*this;
+                return previous;
+            }
+
+            bool operator==(const iterator& other) const noexcept
+            {
+                return index_ == other.index_;
+            }
+
+        private:
+            const path_store* store_{ nullptr };
+            std::size_t index_{ 0 };
+            path_kind kind_{ path_kind::polyline };
+
+            void skip() noexcept
+            {
+                while (index_ < store_->size() && store_->kind(index_) != kind_)
+                {
+                    ++index_;
+                }
+            }
+        };
+
+        kind_range(const path_store* store, path_kind kind) noexcept
+            : store_{ store }
+            , kind_{ kind }
+        {
+        }
+
+        iterator begin() const noexcept
+        {
+            return { store_, 0, kind_ };
+        }
+
+        iterator end() const noexcept
+        {
+            return { store_, store_->size(), kind_ };
+        }
+
+    private:
+        const path_store* store_;
+        path_kind kind_;
+    };
+
+    template<class View>
+    kind_range<View> views(path_kind kind) const noexcept
+    {
+        return { this, kind };
+    }
+};
+
+} // namespace infill::geometry
+
+#endif // INFILL_PATH_STORE_H
@@ -0,0 +1,284 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_PERF_COUNTERS_H
+#define INFILL_PERF_COUNTERS_H
+
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+#if __has_include(<linux/perf_event.h>) && __has_include(<sys/syscall.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define INFILL_HAS_PERF_EVENTS
+#endif
+
+namespace infill
+{
+
+/*! Hardware performance counters, summed up per pipeline stage
+ *
+ * Every thread opens one perf event group the first time it enters a stage: cycles, instructions, cache misses and
+ * branch misses. perf events only count the thread that opened them, so work a stage hands to the WorkPool is measured
+ * on the pool threads by helper scopes and added to the stage of the thread that handed it over. The group is scheduled
+ * onto the PMU as a whole, so the ratios stay meaningful even when the kernel multiplexes the counters. Sampling is off
+ * unless enabled; when perf events are unavailable, for example because of perf_event_paranoid, in a container or on
+ * another OS, a warning is logged once and the stages are not measured.
+ */
+class PerfCounters
+{
+public:
+    enum event : std::size_t
+    {
+        cycles,
+        instructions,
+        cache_misses,
+        branch_misses,
+        event_count
+    };
+
+    using values_t = std::array<std::uint64_t, event_count>;
+
+    static PerfCounters& global()
+    {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    void enable() noexcept
+    {
+#ifdef INFILL_HAS_PERF_EVENTS
+        enabled_.store(true, std::memory_order_relaxed);
+#else
+        spdlog::warn("Hardware performance counters are not available on this platform");
+#endif
+    }
+
+    [[nodiscard]] bool enabled() const noexcept
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    /*! Current counter values of the calling thread, false if its counters could not be opened */
+    bool read(values_t& values)
+    {
+#ifdef INFILL_HAS_PERF_EVENTS
+        thread_local Group group;
+        if (! group.opened)
+        {
+            group.open();
+            if (group.leader < 0 && ! warned_.exchange(true))
+            {
+                spdlog::warn("Could not open hardware performance counters, stages are not measured "
+                             "(check perf_event_paranoid)");
+            }
+        }
+        return group.read(values);
+#else
+        return false;
+#endif
+    }
+
+    /*! Add the counters of one scope to the stage, helper scopes on pool threads do not count as a call */
+    void record(std::string_view stage, const values_t& delta, bool call = true)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto& totals = stages_[stage];
+        totals.calls += call ? 1 : 0;
+        for (std::size_t i = 0; i < event_count; ++i)
+        {
+            totals.values[i] += delta[i];
+        }
+    }
+
+    void report() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        for (const auto& [stage, totals] : stages_)
+        {
+            const auto& v = totals.values;
+            const auto per_kilo_instruction = [&v](std::uint64_t value)
+            {
+                const auto instructions_run = static_cast<double>(v[instructions]);
+                return v[instructions] == 0 ? 0.0 : 1000.0 * static_cast<double>(value) / instructions_run;
+            };
+            spdlog::info(
+                "[perf] {}: calls: {}, cycles: {}, instructions: {}, IPC: {:.2f}, "
+                "cache misses per 1k instructions: {:.2f}, branch misses per 1k instructions: {:.2f}",
+                stage,
+                totals.calls,
+                v[cycles],
+                v[instructions],
+                v[cycles] == 0 ? 0.0 : static_cast<double>(v[instructions]) / static_cast<double>(v[cycles]),
+                per_kilo_instruction(v[cache_misses]),
+                per_kilo_instruction(v[branch_misses]));
+        }
+    }
+
+private:
+    struct Totals
+    {
+        std::uint64_t calls{ 0 };
+        values_t values{};
+    };
+
+    std::atomic<bool> enabled_{ false };
+    std::atomic<bool> warned_{ false };
+    mutable std::mutex mutex_;
+    std::map<std::string_view, Totals> stages_;
+
+#ifdef INFILL_HAS_PERF_EVENTS
+    /*! The event group of one thread, events the PMU does not offer are left out and read as zero */
+    struct Group
+    {
+        bool opened{ false };
+        int leader{ -1 };
+        std::array<int, event_count> fds{ -1, -1, -1, -1 };
+
+        ~Group()
+        {
+            for (const auto fd : fds)
+            {
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+            }
+        }
+
+        void open() noexcept
+        {
+            opened = true;
+            constexpr std::array<std::uint64_t, event_count> configs{ PERF_COUNT_HW_CPU_CYCLES,
+                                                                      PERF_COUNT_HW_INSTRUCTIONS,
+                                                                      PERF_COUNT_HW_CACHE_MISSES,
+                                                                      PERF_COUNT_HW_BRANCH_MISSES };
+            for (std::size_t i = 0; i < event_count; ++i)
+            {
+                perf_event_attr attr{};
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(perf_event_attr);
+                attr.config = configs[i];
+                attr.disabled = leader < 0 ? 1 : 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                fds[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+                if (fds[i] >= 0 && leader < 0)
+                {
+                    leader = fds[i];
+                }
+            }
+            if (leader >= 0)
+            {
+                ::ioctl(leader, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        bool read(values_t& values) const noexcept
+        {
+            if (leader < 0)
+            {
+                return false;
+            }
+            std::array<std::uint64_t, 1 + event_count> buffer{};
+            if (::read(leader, buffer.data(), sizeof(buffer)) < static_cast<ssize_t>(sizeof(std::uint64_t)))
+            {
+                return false;
+            }
+            // The group returns the values of the opened events in the order they joined it.
+            std::size_t next{ 1 };
+            for (std::size_t i = 0; i < event_count; ++i)
+            {
+                values[i] = fds[i] >= 0 && next <= buffer[0] ? buffer[next++] : 0;
+            }
+            return true;
+        }
+    };
+#endif
+};
+
+/*! Measures the hardware counters of the calling thread while the scope is alive, if sampling is enabled
+ *
+ * The innermost active stage of a thread is its current stage, which the WorkPool passes on to its helpers.
+ */
+class PerfStage
+{
+public:
+    struct helper_t
+    {
+    };
+    static constexpr helper_t helper{};
+
+    explicit PerfStage(std::string_view stage)
+        : stage_{ stage }
+        , active_{ PerfCounters::global().enabled() && PerfCounters::global().read(start_) }
+        , previous_{ active_ ? std::exchange(current_, stage) : current_ }
+    {
+    }
+
+    /*! Measures work done on behalf of a stage of another thread, adding to it without counting as a call */
+    PerfStage(std::string_view stage, helper_t)
+        : PerfStage{ stage }
+    {
+        call_ = false;
+    }
+
+    PerfStage(const PerfStage&) = delete;
+    PerfStage& operator=(const PerfStage&) = delete;
+
+    ~PerfStage()
+    {
+        PerfCounters::values_t end{};
+        if (! active_)
+        {
+            return;
+        }
+        current_ = previous_;
+        if (! PerfCounters::global().read(end))
+        {
+            return;
+        }
+        for (std::size_t i = 0; i < PerfCounters::event_count; ++i)
+        {
+            end[i] -= start_[i];
+        }
+        try
+        {
+            PerfCounters::global().record(stage_, end, call_);
+        }
+        catch (...)
+        {
+            // Instrumentation must never fail the request it measures.
+        }
+    }
+
+    /*! The innermost measured stage of the calling thread, empty outside of one */
+    [[nodiscard]] static std::string_view current() noexcept
+    {
+        return current_;
+    }
+
+private:
+    inline static thread_local std::string_view current_;
+
+    std::string_view stage_;
+    PerfCounters::values_t start_{};
+    bool active_;
+    std::string_view previous_;
+    bool call_{ true };
+};
+
+} // namespace infill
+
+#endif // INFILL_PERF_COUNTERS_H
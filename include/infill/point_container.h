@@ -10,6 +10,7 @@
 #include <range/v3/view/drop.hpp>
 #include <range/v3/view/transform.hpp>
 
+#include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <vector>
@@ -19,6 +20,15 @@ namespace infill::geometry
 
 using Point = ClipperLib::IntPoint;
 
+/*! A point relative to a local origin, with half the footprint of a Point */
+struct LocalPoint
+{
+    std::int32_t X{ 0 };
+    std::int32_t Y{ 0 };
+};
+
+static_assert(concepts::point2d<LocalPoint> && concepts::local_point2d<LocalPoint>);
+
 /*! The base clase of all point based container types
  *
  * @tparam P
@@ -0,0 +1,486 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_RESULT_CACHE_H
+#define INFILL_RESULT_CACHE_H
+
+#include "infill/embedded_tiles.h"
+#include "infill/hash.h"
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+#include "infill/tile_geometry.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif
+
+namespace infill
+{
+
+/*! Directory of generate results that outlives the plugin process
+ *
+ * Results are keyed by everything the result depends on: the outlines, the content of the layer file, the infill scale,
+ * the center, the clip partitions and the plugin version. The file name is a hash of the key, the key itself is stored
+ * in the entry and compared on every hit, so two keys with the same hash never serve each other's result. Every result is one file, written under a temporary name and renamed
+ * into place, so a crash never leaves a truncated entry behind and several processes can share the directory. Points
+ * are stored as zigzag varint deltas to the previous point, which shrinks infill paths to a fraction of their in-memory
+ * size. A hit refreshes the modification time of its file; once the directory grows beyond its capacity the files that
+ * were not used for the longest time are removed.
+ */
+class ResultCache
+{
+public:
+    static constexpr std::uint32_t format_version{ 2 };
+    static constexpr std::size_t max_content_hashes{ 4096 }; //!< Layer files whose content hash is remembered
+
+    /*! What a result depends on, the outlines and the layer file as digests */
+    struct Key
+    {
+        std::uint64_t version; //!< Hash of the plugin version and the format version
+        std::uint64_t content; //!< Hash of the layer file
+        std::uint64_t outline; //!< Hash of the outer contours
+        std::int64_t infill_scale;
+        std::int64_t center_x;
+        std::int64_t center_y;
+        std::uint64_t clip_partitions;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    ResultCache(std::filesystem::path directory, std::size_t capacity, std::string_view plugin_version)
+        : directory_{ std::move(directory) }
+        , capacity_{ capacity }
+        , salt_{ Fnv1a{}.update(plugin_version).update(format_version).value() }
+    {
+        std::filesystem::create_directories(directory_);
+        for (const auto& entry : std::filesystem::directory_iterator{ directory_ })
+        {
+            if (entry.is_regular_file() && entry.path().extension() == ".result")
+            {
+                size_ += entry.file_size();
+            }
+        }
+    }
+
+    /*! Key of the result of clipping the given layer file against the outlines */
+    Key key(
+        const std::filesystem::path& content_path,
+        const auto& outer_contours,
+        const int64_t infill_scale,
+        const int64_t center_x,
+        const int64_t center_y,
+        const std::size_t clip_partitions)
+    {
+        Fnv1a outline;
+        for (const auto& contour : outer_contours)
+        {
+            outline.update(static_cast<std::uint64_t>(std::size(contour)));
+            for (const auto& point : contour)
+            {
+                outline.update(static_cast<std::int64_t>(point.X)).update(static_cast<std::int64_t>(point.Y));
+            }
+        }
+        return { .version = salt_,
+                 .content = contentHash(content_path),
+                 .outline = outline.value(),
+                 .infill_scale = infill_scale,
+                 .center_x = center_x,
+                 .center_y = center_y,
+                 .clip_partitions = clip_partitions };
+    }
+
+    std::optional<geometry::path_store<>> get(const Key& key)
+    {
+        const auto file = entryPath(key);
+        std::ifstream stream{ file, std::ios::binary };
+        if (! stream)
+        {
+            return std::nullopt;
+        }
+        std::optional<geometry::path_store<>> result;
+        try
+        {
+            const std::vector<std::uint8_t> buffer{ std::istreambuf_iterator<char>{ stream }, std::istreambuf_iterator<char>{} };
+            result = decode(buffer, key);
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::warn("Could not read result cache entry {}: {}", file.string(), e.what());
+        }
+        if (! result.has_value())
+        {
+            spdlog::warn("Removing unreadable result cache entry {}", file.string());
+            std::error_code error;
+            std::filesystem::remove(file, error);
+            return std::nullopt;
+        }
+        std::error_code error;
+        std::filesystem::last_write_time(file, std::filesystem::file_time_type::clock::now(), error);
+        return result;
+    }
+
+    void put(const Key& key, const geometry::path_store<>& result)
+    {
+        static std::atomic<std::uint64_t> counter{ 0 };
+        const auto file = entryPath(key);
+        const auto temporary = std::filesystem::path{ file }.concat(fmt::format(".{}.{}.tmp", processId(), counter++));
+        const auto buffer = encode(result, key);
+        std::uintmax_t replaced{ 0 };
+        try
+        {
+            {
+                std::ofstream stream{ temporary, std::ios::binary | std::ios::trunc };
+                stream.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+                if (! stream)
+                {
+                    throw std::runtime_error(fmt::format("failed to write {}", temporary.string()));
+                }
+            }
+            // An entry stored before under the same key is replaced, its size no longer counts.
+            std::error_code error;
+            if (const auto size = std::filesystem::file_size(file, error); ! error)
+            {
+                replaced = size;
+            }
+            std::filesystem::rename(temporary, file);
+        }
+        catch (const std::exception& e)
+        {
+            std::error_code error;
+            std::filesystem::remove(temporary, error);
+            spdlog::warn("Could not store result in the cache: {}", e.what());
+            return;
+        }
+
+        {
+            std::scoped_lock lock{ mutex_ };
+            size_ += buffer.size();
+            size_ -= std::min<std::size_t>(replaced, size_);
+            if (size_ <= capacity_ || std::exchange(evicting_, true))
+            {
+                return;
+            }
+        }
+        evict();
+    }
+
+private:
+    struct Header
+    {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t reserved;
+        Key key;
+        std::uint64_t path_count;
+        std::uint64_t point_count;
+        std::uint64_t payload_size;
+        std::uint64_t checksum;
+    };
+
+    struct ContentHash
+    {
+        FileStamp stamp;
+        std::uint64_t hash;
+        std::list<std::string>::iterator position;
+    };
+
+    static constexpr std::array<char, 8> magic{ 'L', 'I', 'R', 'E', 'S', 'U', 'L', 'T' };
+
+    std::filesystem::path directory_;
+    std::size_t capacity_;
+    std::uint64_t salt_;
+    std::size_t size_{ 0 };
+    bool evicting_{ false }; //!< Whether a put is removing entries, the others skip eviction meanwhile
+    std::mutex mutex_;
+    std::unordered_map<std::string, ContentHash> content_hashes_;
+    std::list<std::string> content_lru_;
+
+    [[nodiscard]] std::filesystem::path entryPath(const Key& key) const
+    {
+        const auto hash = Fnv1a{}
+                              .update(key.version)
+                              .update(key.content)
+                              .update(key.outline)
+                              .update(key.infill_scale)
+                              .update(key.center_x)
+                              .update(key.center_y)
+                              .update(key.clip_partitions)
+                              .value();
+        return directory_ / fmt::format("{:016x}.result", hash);
+    }
+
+    static long processId() noexcept
+    {
+#if __has_include(<unistd.h>)
+        return static_cast<long>(::getpid());
+#else
+        return 0;
+#endif
+    }
+
+    /*! Hash of the content of a layer file, only rehashed when its stamp changed */
+    std::uint64_t contentHash(const std::filesystem::path& filepath)
+    {
+        if (const auto* embedded = findEmbedded(filepath))
+        {
+            // Hashes the arrays rather than the path, a build with other tiles under the same name misses.
+            return Fnv1a{}
+                .update(embedded->set)
+                .update(embedded->pattern)
+                .update(embedded->z)
+                .update(std::as_bytes(embedded->offsets))
+                .update(std::as_bytes(embedded->kinds))
+                .update(std::as_bytes(embedded->points))
+                .value();
+        }
+        const auto stamp = FileStamp::of(filepath);
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (auto it = content_hashes_.find(filepath.string()); it != content_hashes_.end() && it->second.stamp == stamp)
+            {
+                content_lru_.splice(content_lru_.begin(), content_lru_, it->second.position);
+                return it->second.hash;
+            }
+        }
+
+        Fnv1a hash;
+        std::ifstream stream{ filepath, std::ios::binary };
+        std::array<char, 1 << 16> chunk;
+        while (stream.read(chunk.data(), chunk.size()) || stream.gcount() > 0)
+        {
+            hash.update(std::string_view{ chunk.data(), static_cast<std::size_t>(stream.gcount()) });
+        }
+
+        std::scoped_lock lock{ mutex_ };
+        if (auto it = content_hashes_.find(filepath.string()); it != content_hashes_.end())
+        {
+            content_lru_.splice(content_lru_.begin(), content_lru_, it->second.position);
+            it->second.stamp = stamp;
+            it->second.hash = hash.value();
+            return hash.value();
+        }
+        content_lru_.push_front(filepath.string());
+        content_hashes_.emplace(content_lru_.front(), ContentHash{ .stamp = stamp, .hash = hash.value(), .position = content_lru_.begin() });
+        if (content_hashes_.size() > max_content_hashes)
+        {
+            content_hashes_.erase(content_lru_.back());
+            content_lru_.pop_back();
+        }
+        return hash.value();
+    }
+
+    /*! Remove the least recently used entries until the directory is back at 3/4 of its capacity
+     *
+     * Runs without the lock, which only guards the bookkeeping, so gets and puts of other threads do not wait for the
+     * directory. Puts meanwhile are added to the size found on disk.
+     */
+    void evict()
+    {
+        struct Entry
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            std::uintmax_t size;
+        };
+        std::size_t before{ 0 };
+        {
+            std::scoped_lock lock{ mutex_ };
+            before = size_;
+        }
+        std::vector<Entry> entries;
+        std::error_code error;
+        std::size_t size{ 0 };
+        for (const auto& entry : std::filesystem::directory_iterator{ directory_, error })
+        {
+            if (entry.is_regular_file(error) && entry.path().extension() == ".result")
+            {
+                entries.push_back({ .path = entry.path(), .used = entry.last_write_time(error), .size = entry.file_size(error) });
+                size += entries.back().size;
+            }
+        }
+        std::sort(
+            entries.begin(),
+            entries.end(),
+            [](const auto& lhs, const auto& rhs)
+            {
+                return lhs.used < rhs.used;
+            });
+        for (const auto& entry : entries)
+        {
+            if (size <= capacity_ / 4 * 3)
+            {
+                break;
+            }
+            if (std::filesystem::remove(entry.path, error))
+            {
+                size -= entry.size;
+            }
+        }
+
+        std::scoped_lock lock{ mutex_ };
+        size_ = size + (size_ > before ? size_ - before : 0);
+        evicting_ = false;
+    }
+
+    static void writeVarint(std::vector<std::uint8_t>& buffer, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<std::uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<std::uint8_t>(value));
+    }
+
+    static bool readVarint(const std::uint8_t*& it, const std::uint8_t* end, std::uint64_t& value) noexcept
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && it != end; shift += 7)
+        {
+            const auto byte = *it++;
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static std::uint64_t zigzag(std::int64_t value) noexcept
+    {
+        return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+    }
+
+    static std::int64_t unzigzag(std::uint64_t value) noexcept
+    {
+        return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+    }
+
+    static std::vector<std::uint8_t> encode(const geometry::path_store<>& result, const Key& key)
+    {
+        std::vector<std::uint8_t> buffer(sizeof(Header));
+        buffer.reserve(sizeof(Header) + result.size() * 2 + result.points().size() * 4);
+        geometry::Point previous{ 0, 0 };
+        for (std::size_t i = 0; i < result.size(); ++i)
+        {
+            const auto path = result.path(i);
+            buffer.push_back(static_cast<std::uint8_t>(result.kind(i)));
+            writeVarint(buffer, path.size());
+            for (const auto& point : path)
+            {
+                writeVarint(buffer, zigzag(point.X - previous.X));
+                writeVarint(buffer, zigzag(point.Y - previous.Y));
+                previous = point;
+            }
+        }
+
+        const auto payload = std::span{ buffer }.subspan(sizeof(Header));
+        const Header header{ .magic = magic,
+                             .version = format_version,
+                             .reserved = 0,
+                             .key = key,
+                             .path_count = result.size(),
+                             .point_count = result.points().size(),
+                             .payload_size = payload.size(),
+                             .checksum = Fnv1a{}.update(std::as_bytes(payload)).value() };
+        std::memcpy(buffer.data(), &header, sizeof(Header));
+        return buffer;
+    }
+
+    static std::optional<geometry::path_store<>> decode(const std::vector<std::uint8_t>& buffer, const Key& key)
+    {
+        if (buffer.size() < sizeof(Header))
+        {
+            return std::nullopt;
+        }
+        Header header;
+        std::memcpy(&header, buffer.data(), sizeof(Header));
+        const auto payload = std::span{ buffer }.subspan(sizeof(Header));
+        if (header.magic != magic || header.version != format_version || header.key != key || header.payload_size != payload.size()
+            || header.checksum != Fnv1a{}.update(std::as_bytes(payload)).value())
+        {
+            return std::nullopt;
+        }
+
+        // The counts are not covered by the checksum. Every path takes at least two bytes of payload, its kind and its
+        // point count, and every point at least two, so larger counts are corrupt and must not size the buffers.
+        if (header.path_count > payload.size() / 2 || header.point_count > payload.size() / 2)
+        {
+            return std::nullopt;
+        }
+        std::vector<geometry::Point> points;
+        std::vector<std::size_t> offsets{ 0 };
+        std::vector<geometry::path_kind> kinds;
+        points.reserve(header.point_count);
+        offsets.reserve(header.path_count + 1);
+        kinds.reserve(header.path_count);
+
+        const auto* it = payload.data();
+        const auto* end = it + payload.size();
+        geometry::Point previous{ 0, 0 };
+        for (std::uint64_t i = 0; i < header.path_count; ++i)
+        {
+            std::uint64_t count{ 0 };
+            if (it == end || *it > static_cast<std::uint8_t>(geometry::path_kind::discarded))
+            {
+                return std::nullopt;
+            }
+            kinds.push_back(static_cast<geometry::path_kind>(*it++));
+            if (! readVarint(it, end, count) || count > header.point_count - points.size())
+            {
+                return std::nullopt;
+            }
+            for (std::uint64_t j = 0; j < count; ++j)
+            {
+                std::uint64_t dx{ 0 };
+                std::uint64_t dy{ 0 };
+                if (! readVarint(it, end, dx) || ! readVarint(it, end, dy))
+                {
+                    return std::nullopt;
+                }
+                previous = { previous.X + unzigzag(dx), previous.Y + unzigzag(dy) };
+                points.push_back(previous);
+            }
+            offsets.push_back(points.size());
+        }
+        if (it != end || points.size() != header.point_count)
+        {
+            return std::nullopt;
+        }
+
+        geometry::path_store<> result;
+        result.append(
+            geometry::path_store_view<>{ .points = points, .offsets = offsets, .kinds = kinds },
+            [](const auto& point)
+            {
+                return point;
+            });
+        return result;
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_RESULT_CACHE_H
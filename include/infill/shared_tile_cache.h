@@ -0,0 +1,254 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_SHARED_TILE_CACHE_H
+#define INFILL_SHARED_TILE_CACHE_H
+
+#include "infill/hash.h"
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+#include "infill/tile_geometry.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define INFILL_HAS_MMAP
+#endif
+
+namespace infill
+{
+
+/*! Cache of parsed tiles in memory mapped files, shared by all plugin processes on a host
+ *
+ * Every tile is published once as a file in the cache directory, holding the flat buffers of its TileGeometry, and
+ * mapped read-only by every process that needs it, so the pages are shared between processes. A file is written under
+ * a unique temporary name and renamed into place, so readers only ever see complete files and concurrent publishers of
+ * the same tile simply replace each other. The header records the layout version and the stamp of the source file; a
+ * file that does not match is republished. Platforms without mmap fall back to parsing into process memory.
+ */
+class SharedTileCache
+{
+public:
+    using tile_t = TileGeometry<>;
+    using shared_tile_t = std::shared_ptr<const tile_t>;
+    using point_t = geometry::LocalPoint;
+
+    static constexpr std::uint32_t format_version{ 1 };
+
+    explicit SharedTileCache(std::filesystem::path directory)
+        : directory_{ std::move(directory) }
+    {
+        std::filesystem::create_directories(directory_);
+    }
+
+    shared_tile_t get(const std::filesystem::path& filepath, const FileStamp& stamp)
+    {
+#ifdef INFILL_HAS_MMAP
+        const auto cache_file = directory_ / fmt::format("{:016x}.tile", Fnv1a::of(std::filesystem::absolute(filepath).string()));
+        if (auto tile = map(cache_file, stamp))
+        {
+            return tile;
+        }
+        const auto tile = tile_t::load(filepath);
+        try
+        {
+            publish(cache_file, *tile, stamp);
+            if (auto mapped = map(cache_file, stamp))
+            {
+                return mapped;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::warn("Could not publish tile {} to the shared cache: {}", filepath.string(), e.what());
+        }
+        return tile;
+#else
+        return tile_t::load(filepath);
+#endif
+    }
+
+private:
+    struct Header
+    {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t point_size;
+        FileStamp stamp;
+        std::int64_t origin_x;
+        std::int64_t origin_y;
+        std::int64_t bounding_box[4];
+        std::uint64_t path_count;
+        std::uint64_t point_count;
+    };
+
+    static constexpr std::array<char, 8> magic{ 'L', 'I', 'T', 'I', 'L', 'E', '\0', '\0' };
+
+    std::filesystem::path directory_;
+
+    static constexpr std::size_t align(std::size_t size) noexcept
+    {
+        return (size + 7) & ~std::size_t{ 7 };
+    }
+
+    /*! Byte offsets of the offsets, kinds and points sections and the total size of a file with the given counts */
+    static std::array<std::size_t, 4> layout(std::uint64_t path_count, std::uint64_t point_count) noexcept
+    {
+        const auto offsets = align(sizeof(Header));
+        const auto kinds = offsets + align((path_count + 1) * sizeof(std::size_t));
+        const auto points = kinds + align(path_count * sizeof(geometry::path_kind));
+        return { offsets, kinds, points, points + point_count * sizeof(point_t) };
+    }
+
+#ifdef INFILL_HAS_MMAP
+    static_assert(sizeof(std::size_t) == sizeof(std::uint64_t), "The cache file layout stores offsets as 64-bit values");
+
+    static void publish(const std::filesystem::path& cache_file, const tile_t& tile, const FileStamp& stamp)
+    {
+        static std::atomic<std::uint64_t> counter{ 0 };
+        const auto temporary = std::filesystem::path{ cache_file }.concat(fmt::format(".{}.{}.tmp", ::getpid(), counter++));
+
+        const Header header{ .magic = magic,
+                             .version = format_version,
+                             .point_size = sizeof(point_t),
+                             .stamp = stamp,
+                             .origin_x = tile.origin.X,
+                             .origin_y = tile.origin.Y,
+                             .bounding_box = { tile.bounding_box.front().X, tile.bounding_box.front().Y, tile.bounding_box.back().X, tile.bounding_box.back().Y },
+                             .path_count = tile.paths.size(),
+                             .point_count = tile.paths.points.size() };
+        const auto [offsets, kinds, points, size] = layout(header.path_count, header.point_count);
+
+        std::vector<char> buffer(size, 0);
+        std::memcpy(buffer.data(), &header, sizeof(Header));
+        std::memcpy(buffer.data() + offsets, tile.paths.offsets.data(), tile.paths.offsets.size_bytes());
+        std::memcpy(buffer.data() + kinds, tile.paths.kinds.data(), tile.paths.kinds.size_bytes());
+        std::memcpy(buffer.data() + points, tile.paths.points.data(), tile.paths.points.size_bytes());
+        {
+            std::ofstream file{ temporary, std::ios::binary | std::ios::trunc };
+            file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            if (! file)
+            {
+                throw std::runtime_error(fmt::format("failed to write {}", temporary.string()));
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, cache_file, error);
+        if (error)
+        {
+            std::filesystem::remove(temporary, error);
+            throw std::runtime_error(fmt::format("failed to publish {}", cache_file.string()));
+        }
+        spdlog::debug("Published tile {} with {} paths", cache_file.string(), header.path_count);
+    }
+
+    /*! Whether the paths stay within the points: offsets starting at 0, never decreasing and ending at point_count */
+    static bool valid(std::span<const std::size_t> offsets, std::span<const geometry::path_kind> kinds, std::uint64_t point_count) noexcept
+    {
+        if (offsets.front() != 0 || offsets.back() != point_count)
+        {
+            return false;
+        }
+        for (std::size_t i = 1; i < offsets.size(); ++i)
+        {
+            if (offsets[i] < offsets[i - 1])
+            {
+                return false;
+            }
+        }
+        return std::all_of(
+            kinds.begin(),
+            kinds.end(),
+            [](geometry::path_kind kind)
+            {
+                return kind <= geometry::path_kind::discarded;
+            });
+    }
+
+    static shared_tile_t map(const std::filesystem::path& cache_file, const FileStamp& stamp)
+    {
+        const auto fd = ::open(cache_file.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info
+        {
+        };
+        if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(Header))
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        const auto length = static_cast<std::size_t>(info.st_size);
+        auto* address = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        std::shared_ptr<const void> mapping{ address,
+                                             [length](const void* p)
+                                             {
+                                                 ::munmap(const_cast<void*>(p), length);
+                                             } };
+
+        const auto* bytes = static_cast<const char*>(address);
+        Header header;
+        std::memcpy(&header, bytes, sizeof(Header));
+        if (header.magic != magic || header.version != format_version || header.point_size != sizeof(point_t) || ! (header.stamp == stamp))
+        {
+            return nullptr;
+        }
+        // Bounding the counts by the file first keeps the layout computation from overflowing.
+        if (header.path_count >= length / sizeof(std::size_t) || header.point_count > length / sizeof(point_t))
+        {
+            spdlog::warn("Ignoring shared tile {} with counts exceeding its size", cache_file.string());
+            return nullptr;
+        }
+        const auto [offsets, kinds, points, size] = layout(header.path_count, header.point_count);
+        if (size != length)
+        {
+            return nullptr;
+        }
+        if (! valid(
+                { reinterpret_cast<const std::size_t*>(bytes + offsets), header.path_count + 1 },
+                { reinterpret_cast<const geometry::path_kind*>(bytes + kinds), header.path_count },
+                header.point_count))
+        {
+            spdlog::warn("Ignoring corrupt shared tile {}", cache_file.string());
+            return nullptr;
+        }
+
+        auto tile = std::make_shared<tile_t>();
+        tile->origin = { header.origin_x, header.origin_y };
+        tile->bounding_box = { { header.bounding_box[0], header.bounding_box[1] }, { header.bounding_box[2], header.bounding_box[3] } };
+        tile->paths.offsets = { reinterpret_cast<const std::size_t*>(bytes + offsets), header.path_count + 1 };
+        tile->paths.kinds = { reinterpret_cast<const geometry::path_kind*>(bytes + kinds), header.path_count };
+        tile->paths.points = { reinterpret_cast<const point_t*>(bytes + points), header.point_count };
+        tile->storage = std::move(mapping);
+        tile->storage_size = length;
+        return tile;
+    }
+#endif
+};
+
+} // namespace infill
+
+#endif // INFILL_SHARED_TILE_CACHE_H
@@ -1,9 +1,13 @@
 // Copyright (c) 2024 Michael Jaeger, Marie Schmid
 // curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
 
-#include "infill/content_reader.h"
+#include "infill/alloc_profiler.h"
+#include "infill/concepts.h"
 #include "infill/geometry.h"
+#include "infill/path_store.h"
+#include "infill/perf_counters.h"
 #include "infill/point_container.h"
+#include "infill/tile_cache.h"
 
 #include <fmt/ranges.h>
 #include <range/v3/all.hpp>
@@ -11,6 +15,8 @@
 
 #include <cmath>
 #include <filesystem>
+#include <memory>
+#include <memory_resource>
 #include <numbers>
 #include <vector>
 
@@ -20,17 +26,27 @@ namespace infill
 class Tile
 {
 public:
-    using value_type = std::tuple<std::vector<geometry::polyline<>>, std::vector<geometry::polygon_outer<>>>;
+    using value_type = geometry::path_store<>;
     int64_t x{ 0 };
     int64_t y{ 0 };
     std::filesystem::path filepath{};
     int64_t magnitude{ 1 };
 
-    value_type render(const bool contour) const noexcept
+    std::shared_ptr<TileCache> cache{};
+
+    value_type render(const bool contour, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const
+    {
+        value_type paths{ resource };
+        renderInto(paths);
+        return paths;
+    }
+
+    /*! Render the tile and append its paths to the given store, saving the copy of a separately rendered tile */
+    void renderInto(value_type& paths) const
     {
-        auto content = readContent(filepath);
-        content = fitContent(content);
-        return content;
+        const AllocStage alloc_stage{ "render" };
+        const auto content = cache ? cache->get(filepath) : TileCache::load(filepath);
+        fitContent(*content, paths);
     }
 
 private:
@@ -43,48 +59,21 @@ private:
                                         { x + static_cast<coord_t>(magnitude / 2), y + static_cast<coord_t>(magnitude / -2) } };
     }
 
-    value_type fitContent(value_type& content) const noexcept
+    /*! Widen the local tile geometry to full points, centered on the tile and scaled to its magnitude */
+    template<concepts::local_point2d P>
+    void fitContent(const TileGeometry<P>& content, value_type& paths) const
     {
-        auto bb_lines = std::get<0>(content)
-                      | ranges::views::transform(
-                            [](const auto& contour)
-                            {
-                                return geometry::computeBoundingBox(contour);
-                            })
-                      | ranges::views::join;
-        auto bb_polys = std::get<1>(content)
-                      | ranges::views::transform(
-                            [](const auto& contour)
-                            {
-                                return geometry::computeBoundingBox(contour);
-                            })
-                      | ranges::views::join;
-        auto bounding_boxes = ranges::views::concat(bb_lines, bb_polys) | ranges::to_vector;
-        auto bb = geometry::computeBoundingBox(bounding_boxes);
-
-        // Center and scale the content in the tile.
-        auto center = geometry::computeCoG(bb);
+        const PerfStage perf_stage{ "fitContent" };
+        // Center and scale the content in the tile, the points are already relative to the center of the content.
+        const auto offset = -geometry::computeCoG(content.bounding_box);
         double scale_factor =  (magnitude / 100.0);
         spdlog::info("scale_factor: {}", scale_factor);
-        for (auto& line : std::get<0>(content))
-        {
-            for (auto& point : line)
-            {
-                point.X = x + static_cast<int64_t>(scale_factor * (point.X - center.X));
-                point.Y = y + static_cast<int64_t>(scale_factor * (point.Y - center.Y));
-            }
-        }
-        for (auto& poly : std::get<1>(content))
-        {
-            for (auto& point : poly)
+        paths.append(
+            content.paths,
+            [this, offset, scale_factor](const P& point)
             {
-                point.X = x + static_cast<int64_t>(scale_factor * (point.X - center.X));
-                point.Y = y + static_cast<int64_t>(scale_factor * (point.Y - center.Y));
-            }
-        }
-        // remove the first polygon, which is the bounding box of the content.
-        std::get<1>(content).erase(std::get<1>(content).begin());
-        return content;
+                return geometry::Point{ x + static_cast<int64_t>(scale_factor * (point.X + offset.X)), y + static_cast<int64_t>(scale_factor * (point.Y + offset.Y)) };
+            });
     }
 };
 } // namespace infill
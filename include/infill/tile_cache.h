@@ -0,0 +1,343 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_TILE_CACHE_H
+#define INFILL_TILE_CACHE_H
+
+#include "infill/embedded_tiles.h"
+#include "infill/memory_governor.h"
+#include "infill/shared_tile_cache.h"
+#include "infill/tile_geometry.h"
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace infill
+{
+
+/*! Process wide cache of parsed tile files
+ *
+ * Entries are keyed by path and invalidated when the modification time or size of the file changes. The least recently
+ * used entries are evicted once the total memory of all entries exceeds the capacity. Concurrent misses on the same file
+ * are coalesced into a single load. Tiles compiled into the executable are served straight from their arrays, without
+ * looking at the file. The cache is registered with the memory governor, which may shrink it below its capacity.
+ */
+class TileCache
+{
+public:
+    using tile_t = TileGeometry<>;
+    using shared_tile_t = std::shared_ptr<const tile_t>;
+
+    explicit TileCache(std::size_t capacity = std::size_t{ 512 } << 20, std::shared_ptr<SharedTileCache> shared = nullptr)
+        : capacity_{ capacity }
+        , shared_{ std::move(shared) }
+    {
+        registration_ = MemoryGovernor::global().add(
+            "tile cache",
+            MemoryGovernor::Priority::parsed,
+            [this]
+            {
+                return size();
+            },
+            [this](std::size_t bytes)
+            {
+                return shrink(bytes);
+            });
+    }
+
+    shared_tile_t get(const std::filesystem::path& filepath)
+    {
+        if (const auto* embedded = findEmbedded(filepath))
+        {
+            return embedded->geometry();
+        }
+        const auto key = filepath.string();
+        const auto stamp = FileStamp::of(filepath);
+        std::promise<shared_tile_t> promise;
+        std::shared_future<shared_tile_t> pending;
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (auto it = entries_.find(key); it != entries_.end())
+            {
+                if (it->second.stamp == stamp)
+                {
+                    lru_.splice(lru_.begin(), lru_, it->second.position);
+                    return it->second.tile;
+                }
+                erase(it);
+            }
+
+            // Only the first caller for a file loads it, concurrent callers wait for its result, including its exception.
+            if (auto it = loading_.find(key); it != loading_.end() && it->second.stamp == stamp)
+            {
+                pending = it->second.tile;
+            }
+            else
+            {
+                loading_.insert_or_assign(key, Load{ .tile = promise.get_future().share(), .stamp = stamp });
+            }
+        }
+        if (pending.valid())
+        {
+            return pending.get();
+        }
+
+        shared_tile_t tile;
+        try
+        {
+            tile = shared_ ? shared_->get(filepath, stamp) : loadOrParse(filepath, stamp);
+        }
+        catch (...)
+        {
+            promise.set_exception(std::current_exception());
+            std::scoped_lock lock{ mutex_ };
+            eraseLoad(key, stamp);
+            throw;
+        }
+        promise.set_value(tile);
+
+        std::scoped_lock lock{ mutex_ };
+        eraseLoad(key, stamp);
+        if (! entries_.contains(key))
+        {
+            lru_.push_front(key);
+            entries_.emplace(key, Entry{ .tile = tile, .stamp = stamp, .position = lru_.begin() });
+            size_ += tile->memoryUsage();
+            evict();
+        }
+        return tile;
+    }
+
+    static shared_tile_t load(const std::filesystem::path& filepath)
+    {
+        if (const auto* embedded = findEmbedded(filepath))
+        {
+            return embedded->geometry();
+        }
+        return tile_t::load(filepath);
+    }
+
+    /*! Whether get() would have to read the file, in which case its content can be read ahead with provideContent */
+    [[nodiscard]] bool wantsContent(const std::filesystem::path& filepath) const
+    {
+        if (shared_ || findEmbedded(filepath) != nullptr)
+        {
+            return false;
+        }
+        const auto key = filepath.string();
+        const auto stamp = FileStamp::of(filepath);
+        std::scoped_lock lock{ mutex_ };
+        const auto entry = entries_.find(key);
+        return (entry == entries_.end() || ! (entry->second.stamp == stamp)) && ! loading_.contains(key) && ! provided_.contains(key);
+    }
+
+    /*! Whether get() returns the file without loading it */
+    [[nodiscard]] bool contains(const std::filesystem::path& filepath) const
+    {
+        if (findEmbedded(filepath) != nullptr)
+        {
+            return true;
+        }
+        const auto stamp = FileStamp::of(filepath);
+        std::scoped_lock lock{ mutex_ };
+        const auto entry = entries_.find(filepath.string());
+        return entry != entries_.end() && entry->second.stamp == stamp;
+    }
+
+    /*! The cached layer file closest in height to the given one, in the same directory and of the same pattern
+     *
+     * Layer files are named <z>_<pattern>.wkt, files not following that scheme are never returned.
+     */
+    [[nodiscard]] std::optional<std::filesystem::path> nearestCached(const std::filesystem::path& filepath) const
+    {
+        const auto layer = layerOf(filepath);
+        if (! layer.has_value())
+        {
+            return std::nullopt;
+        }
+        std::optional<std::filesystem::path> nearest;
+        std::int64_t nearest_distance{ std::numeric_limits<std::int64_t>::max() };
+        std::scoped_lock lock{ mutex_ };
+        for (const auto& [key, entry] : entries_)
+        {
+            std::filesystem::path candidate{ key };
+            const auto candidate_layer = layerOf(candidate);
+            if (! candidate_layer.has_value() || candidate_layer->second != layer->second || candidate.parent_path() != filepath.parent_path())
+            {
+                continue;
+            }
+            const auto distance = std::abs(candidate_layer->first - layer->first);
+            if (distance > 0 && distance < nearest_distance)
+            {
+                nearest = std::move(candidate);
+                nearest_distance = distance;
+            }
+        }
+        return nearest;
+    }
+
+    /*! Hand over the content of a file read ahead of time, the next get() parses it instead of reading the file */
+    void provideContent(const std::filesystem::path& filepath, const FileStamp& stamp, std::string content)
+    {
+        std::scoped_lock lock{ mutex_ };
+        if (auto it = provided_.find(filepath.string()); it != provided_.end())
+        {
+            eraseProvided(it);
+        }
+        provided_order_.push_back(filepath.string());
+        provided_size_ += content.size();
+        provided_.emplace(provided_order_.back(), Provided{ .content = std::move(content), .stamp = stamp, .position = std::prev(provided_order_.end()) });
+        // Content of requests that were cancelled before they got to run is never taken, the oldest goes first.
+        while (provided_.size() > max_provided)
+        {
+            eraseProvided(provided_.find(provided_order_.front()));
+        }
+    }
+
+    /*! Drop the content read ahead, then the least recently used tiles until at least bytes were released, returns the
+     * bytes released
+     *
+     * A call whose content is dropped reads the file again when it runs, which is cheaper than parsing an evicted tile.
+     */
+    std::size_t shrink(std::size_t bytes)
+    {
+        std::scoped_lock lock{ mutex_ };
+        const auto before = size_ + provided_size_;
+        dropProvided();
+        while (before - size_ < bytes && ! lru_.empty())
+        {
+            erase(entries_.find(lru_.back()));
+        }
+        return before - size_;
+    }
+
+    /*! The memory of the parsed tiles and of the content read ahead */
+    [[nodiscard]] std::size_t size() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        return size_ + provided_size_;
+    }
+
+private:
+    struct Entry
+    {
+        shared_tile_t tile;
+        FileStamp stamp;
+        std::list<std::string>::iterator position;
+    };
+
+    struct Provided
+    {
+        std::string content;
+        FileStamp stamp;
+        std::list<std::string>::iterator position;
+    };
+
+    static constexpr std::size_t max_provided{ 16 };
+
+    struct Load
+    {
+        std::shared_future<shared_tile_t> tile;
+        FileStamp stamp;
+    };
+
+    std::size_t capacity_;
+    std::shared_ptr<SharedTileCache> shared_;
+    std::size_t size_{ 0 };
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;
+    std::unordered_map<std::string, Load> loading_; //!< Loads in progress, awaited by every other caller of the same file
+    std::unordered_map<std::string, Provided> provided_; //!< Content read ahead, waiting for its get()
+    std::list<std::string> provided_order_; //!< Keys of provided_, the oldest first
+    std::size_t provided_size_{ 0 }; //!< Bytes of content in provided_
+    MemoryGovernor::Registration registration_; //!< Declared last, so it is removed before the entries
+
+    void dropProvided()
+    {
+        provided_.clear();
+        provided_order_.clear();
+        provided_size_ = 0;
+    }
+
+    void eraseProvided(std::unordered_map<std::string, Provided>::iterator it)
+    {
+        provided_size_ -= it->second.content.size();
+        provided_order_.erase(it->second.position);
+        provided_.erase(it);
+    }
+
+    shared_tile_t loadOrParse(const std::filesystem::path& filepath, const FileStamp& stamp)
+    {
+        std::optional<Provided> provided;
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (auto it = provided_.find(filepath.string()); it != provided_.end())
+            {
+                provided_size_ -= it->second.content.size();
+                provided_order_.erase(it->second.position);
+                provided = std::move(it->second);
+                provided_.erase(it);
+            }
+        }
+        if (provided.has_value() && provided->stamp == stamp)
+        {
+            return tile_t::parse(provided->content, filepath);
+        }
+        return load(filepath);
+    }
+
+    /*! Height and pattern of a layer file named <z>_<pattern>.wkt */
+    static std::optional<std::pair<std::int64_t, std::string>> layerOf(const std::filesystem::path& filepath)
+    {
+        const auto filename = filepath.filename().string();
+        const auto separator = filename.find('_');
+        std::int64_t z{ 0 };
+        if (separator == std::string::npos || std::from_chars(filename.data(), filename.data() + separator, z).ptr != filename.data() + separator)
+        {
+            return std::nullopt;
+        }
+        return std::pair{ z, filename.substr(separator + 1) };
+    }
+
+    void eraseLoad(const std::string& key, const FileStamp& stamp)
+    {
+        if (auto it = loading_.find(key); it != loading_.end() && it->second.stamp == stamp)
+        {
+            loading_.erase(it);
+        }
+    }
+
+    void erase(std::unordered_map<std::string, Entry>::iterator it)
+    {
+        size_ -= it->second.tile->memoryUsage();
+        lru_.erase(it->second.position);
+        entries_.erase(it);
+    }
+
+    void evict()
+    {
+        while (size_ > capacity_ && lru_.size() > 1)
+        {
+            erase(entries_.find(lru_.back()));
+        }
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_TILE_CACHE_H
@@ -0,0 +1,125 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_TILE_GEOMETRY_H
+#define INFILL_TILE_GEOMETRY_H
+
+#include "infill/arena.h"
+#include "infill/concepts.h"
+#include "infill/content_reader.h"
+#include "infill/geometry.h"
+#include "infill/path_store.h"
+#include "infill/point_container.h"
+
+#include <spdlog/spdlog.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+
+namespace infill
+{
+
+/*! Identifies the version of a file on disk by its modification time and size */
+struct FileStamp
+{
+    std::int64_t modified{ 0 };
+    std::uint64_t file_size{ 0 };
+
+    static FileStamp of(const std::filesystem::path& filepath)
+    {
+        std::error_code error;
+        FileStamp stamp{ .modified = std::filesystem::last_write_time(filepath, error).time_since_epoch().count() };
+        stamp.file_size = std::filesystem::file_size(filepath, error);
+        return stamp;
+    }
+
+    bool operator==(const FileStamp&) const = default;
+};
+
+/*! The parsed content of a tile file, stored in 32-bit coordinates relative to an origin
+ *
+ * Tile files are authored in a small local frame, so the points are kept as LocalPoint and only widened to full
+ * Points by Tile::render. The bounding box polygon of the file is already discarded and its extent kept in
+ * bounding_box, in local coordinates. The paths are a view, so the geometry can live on the heap or in a mapped file.
+ */
+template<concepts::local_point2d P = geometry::LocalPoint>
+struct TileGeometry
+{
+    geometry::path_store_view<P> paths;
+    geometry::Point origin{ 0, 0 };
+    geometry::BoundingBox bounding_box{ { 0, 0 }, { 0, 0 } };
+    std::shared_ptr<const void> storage{}; //!< Keeps the memory behind paths alive, either a path_store or a mapping
+    std::size_t storage_size{ 0 };
+
+    [[nodiscard]] std::size_t memoryUsage() const noexcept
+    {
+        return sizeof(TileGeometry) + storage_size;
+    }
+
+    /*! Convert freshly read file content, the origin is placed at the center of its bounding box */
+    static TileGeometry fromContent(geometry::path_store<>& content)
+    {
+        TileGeometry tile;
+        const auto bb = geometry::computeBoundingBox(content.points());
+        tile.origin = geometry::computeCoG(bb);
+        tile.bounding_box = { bb.front() - tile.origin, bb.back() - tile.origin };
+        for (const auto& corner : tile.bounding_box)
+        {
+            if (corner.X < std::numeric_limits<std::int32_t>::min() || corner.X > std::numeric_limits<std::int32_t>::max()
+                || corner.Y < std::numeric_limits<std::int32_t>::min() || corner.Y > std::numeric_limits<std::int32_t>::max())
+            {
+                throw std::range_error("Tile content exceeds the range of 32-bit local coordinates");
+            }
+        }
+
+        // remove the first polygon, which is the bounding box of the content.
+        for (std::size_t index = 0; index < content.size(); ++index)
+        {
+            if (content.kind(index) == geometry::path_kind::polygon)
+            {
+                content.discard(index);
+                break;
+            }
+        }
+
+        auto store = std::make_shared<geometry::path_store<P>>();
+        store->append(
+            content.view(),
+            [origin = tile.origin](const geometry::Point& point)
+            {
+                return P{ static_cast<std::int32_t>(point.X - origin.X), static_cast<std::int32_t>(point.Y - origin.Y) };
+            });
+        tile.paths = store->view();
+        tile.storage_size = store->memoryUsage();
+        tile.storage = std::move(store);
+        return tile;
+    }
+
+    static std::shared_ptr<const TileGeometry> load(const std::filesystem::path& filepath)
+    {
+        const auto arena = ArenaPool::global().acquire();
+        auto content = readContent(filepath, arena.resource());
+        auto tile = std::make_shared<const TileGeometry>(fromContent(content));
+        spdlog::debug("Loaded tile {} with {} paths", filepath.string(), tile->paths.size());
+        return tile;
+    }
+
+    /*! Parse the content of the given file that was already read into memory */
+    static std::shared_ptr<const TileGeometry> parse(std::string_view text, const std::filesystem::path& filepath)
+    {
+        const auto arena = ArenaPool::global().acquire();
+        auto content = readContent(text, arena.resource());
+        auto tile = std::make_shared<const TileGeometry>(fromContent(content));
+        spdlog::debug("Parsed tile {} with {} paths", filepath.string(), tile->paths.size());
+        return tile;
+    }
+};
+
+} // namespace infill
+
+#endif // INFILL_TILE_GEOMETRY_H
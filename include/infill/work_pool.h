@@ -0,0 +1,143 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef INFILL_WORK_POOL_H
+#define INFILL_WORK_POOL_H
+
+#include "infill/perf_counters.h"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace infill
+{
+
+/*! Thread pool used to split the work of a single request over the idle cores
+ *
+ * Items are not assigned to threads up front. Every participating thread, including the caller, claims the next
+ * unprocessed item from a shared counter until none are left, so a thread that finishes a cheap item immediately
+ * takes over work that would otherwise wait behind an expensive one. Because the caller participates as well,
+ * parallelFor also makes progress when all pool threads are busy with other requests. The hardware counters of the
+ * helpers are added to the PerfStage the caller is in.
+ */
+class WorkPool
+{
+public:
+    explicit WorkPool(std::size_t thread_count)
+        : thread_count_{ std::max<std::size_t>(thread_count, 1) }
+        , pool_{ thread_count_ }
+    {
+    }
+
+    ~WorkPool()
+    {
+        pool_.join();
+    }
+
+    static WorkPool& global()
+    {
+        static WorkPool pool{ std::thread::hardware_concurrency() };
+        return pool;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return thread_count_;
+    }
+
+    /*! Call fn(i) for every i in [0, count) and return once all calls finished, rethrows the first exception */
+    template<class F>
+    void parallelFor(std::size_t count, F&& fn)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+
+        struct State
+        {
+            std::atomic<std::size_t> next{ 0 };
+            std::size_t count{ 0 };
+            std::size_t done{ 0 };
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto state = std::make_shared<State>();
+        state->count = count;
+
+        auto work = [state, &fn]()
+        {
+            for (auto index = state->next++; index < state->count; index = state->next++)
+            {
+                std::exception_ptr error;
+                try
+                {
+                    fn(index);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                std::scoped_lock lock{ state->mutex };
+                if (error && ! state->error)
+                {
+                    state->error = error;
+                }
+                if (++state->done == state->count)
+                {
+                    state->finished.notify_all();
+                }
+            }
+        };
+
+        // Helpers only touch fn while they hold an unfinished item, and the caller waits for all items below.
+        const auto helpers = std::min(count - 1, thread_count_);
+        const auto stage = PerfStage::current();
+        for (std::size_t i = 0; i < helpers; ++i)
+        {
+            boost::asio::post(
+                pool_,
+                [work, stage]()
+                {
+                    if (stage.empty())
+                    {
+                        work();
+                        return;
+                    }
+                    const PerfStage perf_stage{ stage, PerfStage::helper };
+                    work();
+                });
+        }
+        work();
+
+        std::unique_lock lock{ state->mutex };
+        state->finished.wait(
+            lock,
+            [&state]
+            {
+                return state->done == state->count;
+            });
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+private:
+    std::size_t thread_count_;
+    boost::asio::thread_pool pool_;
+};
+
+} // namespace infill
+
+#endif // INFILL_WORK_POOL_H
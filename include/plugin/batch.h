@@ -0,0 +1,108 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_BATCH_H
+#define PLUGIN_BATCH_H
+
+#include "infill/content_reader.h"
+#include "infill/content_writer.h"
+#include "infill/infill_generator.h"
+#include "infill/work_pool.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace plugin
+{
+
+/*! Generates the infill of a whole layer stack ahead of slicing, to fill the result cache or an output directory
+ *
+ * The outlines directory holds one file per layer named <z>.wkt, with z in µm as the engine sends it. Every line is a
+ * POLYGON of one outline or hole, as the engine passes them to the plugin, so the results land under the same result
+ * cache keys as the ones of the interactive requests. The holes are assigned to their outlines by containment. Layers
+ * are generated in parallel on the work pool.
+ */
+struct Batch
+{
+    std::filesystem::path outlines_path;
+    std::filesystem::path tiles_path;
+    std::string pattern;
+    int64_t infill_scale{ 100 };
+    int64_t center_x{ 0 };
+    int64_t center_y{ 0 };
+    std::filesystem::path output_path; //!< Results are written as <z>.wkt when set
+    infill::InfillGenerator generator;
+
+    /*! Generate all layers, returns the number of layers that failed */
+    std::size_t run() const
+    {
+        std::vector<std::pair<int64_t, std::filesystem::path>> layers;
+        for (const auto& entry : std::filesystem::directory_iterator{ outlines_path })
+        {
+            const auto stem = entry.path().stem().string();
+            int64_t z{ 0 };
+            if (! entry.is_regular_file() || entry.path().extension() != ".wkt" || std::from_chars(stem.data(), stem.data() + stem.size(), z).ptr != stem.data() + stem.size())
+            {
+                spdlog::warn("Skipping {}, outline files are named <z>.wkt", entry.path().string());
+                continue;
+            }
+            layers.emplace_back(z, entry.path());
+        }
+        std::sort(layers.begin(), layers.end());
+        if (! output_path.empty())
+        {
+            std::filesystem::create_directories(output_path);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        std::atomic<std::size_t> failed{ 0 };
+        infill::WorkPool::global().parallelFor(
+            layers.size(),
+            [&](std::size_t index)
+            {
+                const auto& [z, outline_path] = layers[index];
+                try
+                {
+                    std::vector<infill::geometry::polygon_outer<>> contours;
+                    for (const auto& polygon : infill::readContent(outline_path).polygons())
+                    {
+                        auto& contour = contours.emplace_back();
+                        contour.assign(polygon.begin(), polygon.end());
+                    }
+                    const auto outlines = infill::geometry::Islands::fromContours(contours);
+                    const auto content_path = infill::InfillGenerator::layerFile(tiles_path, pattern, z);
+                    const auto result = generator.generate(content_path, outlines, infill_scale, center_x, center_y, z);
+                    if (! output_path.empty())
+                    {
+                        infill::writeContent(output_path / fmt::format("{}.wkt", z), result);
+                    }
+                }
+                catch (const std::exception& e)
+                {
+                    spdlog::error("Layer {} failed: {}", z, e.what());
+                    ++failed;
+                }
+            });
+        spdlog::info(
+            "Generated {} of {} layers in {:.1f} s",
+            layers.size() - failed,
+            layers.size(),
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return failed;
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_BATCH_H
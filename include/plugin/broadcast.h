@@ -39,6 +39,7 @@
 #include "cura/plugins/v0/slot_id.pb.h"
 #include "plugin/metadata.h"
 #include "plugin/settings.h"
+#include "plugin/settings_store.h"
 
 #include <agrpc/asio_grpc.hpp>
 #include <boost/asio/awaitable.hpp>
@@ -60,7 +61,7 @@ namespace plugin
 struct Broadcast
 {
     using service_t = std::shared_ptr<cura::plugins::slots::broadcast::v0::BroadcastService::AsyncService>;
-    using settings_t = std::unordered_map<std::string, Settings>;
+    using settings_t = SettingsStore;
     using shared_settings_t = std::shared_ptr<settings_t>;
     service_t broadcast_service{ std::make_shared<cura::plugins::slots::broadcast::v0::BroadcastService::AsyncService>() };
     shared_settings_t settings{ std::make_shared<settings_t>() };
@@ -84,7 +85,7 @@ struct Broadcast
             grpc::Status status = grpc::Status::OK;
             try
             {
-                settings->insert_or_assign(getUuid(server_context), Settings{ request });
+                settings->publish(getUuid(server_context), Settings{ request });
             }
             catch (const std::exception& e)
             {
@@ -35,12 +35,24 @@
 #ifndef PLUGIN_GENERATE_H
 #define PLUGIN_GENERATE_H
 
+#include "infill/alloc_profiler.h"
+#include "infill/cancellation.h"
+#include "infill/file_reader.h"
 #include "infill/infill_generator.h"
+#include "infill/latency_budget.h"
+#include "infill/path_order.h"
 #include "plugin/broadcast.h"
+#include "plugin/messages.h"
 #include "plugin/metadata.h"
+#include "plugin/scheduler.h"
 #include "plugin/settings.h"
 
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/bind_cancellation_slot.hpp>
+#include <boost/asio/cancellation_signal.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/this_coro.hpp>
 #include <fmt/format.h>
 #include <spdlog/spdlog.h>
 
@@ -53,8 +65,18 @@
 #define USE_EXPERIMENTAL_COROUTINE
 #endif
 
+#include <chrono>
+#include <cmath>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
 
 namespace plugin::infill_generate
 {
@@ -68,28 +90,78 @@ struct Generate
     std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
     std::filesystem::path tiles_path;
     infill::InfillGenerator generator;
+    std::shared_ptr<FairScheduler> scheduler{ std::make_shared<FairScheduler>() };
+    std::shared_ptr<infill::FileReader> file_reader{ std::make_shared<infill::FileReader>() };
+    std::size_t compression_threshold{ 0 }; //!< Responses larger than this are sent gzip compressed if the engine accepts it, 0 disables compression
 
-    boost::asio::awaitable<void> run()
+    boost::asio::awaitable<void> run(agrpc::GrpcContext& grpc_context)
     {
         while (true)
         {
-            grpc::ServerContext server_context;
-            grpc::Status status = grpc::Status::OK;
-            cura::plugins::slots::infill::v0::generate::CallRequest request;
-            grpc::ServerAsyncResponseWriter<Rsp> writer{ &server_context };
-            co_await agrpc::request(&T::RequestCall, *generate_service, server_context, request, writer, boost::asio::use_awaitable);
-            const auto pattern_setting = Settings::getPattern(request.pattern(), metadata->plugin_name, metadata->plugin_version);
-            const auto infill_scale_setting = Settings::retrieveSettings("infill_scale", request, metadata);
-            const auto infill_directory_setting = Settings::retrieveSettings("infill_directory", request, metadata);
-            const auto center_x_setting = Settings::retrieveSettings("center_x", request, metadata);
-            const auto center_y_setting = Settings::retrieveSettings("center_y", request, metadata);
-            const auto z_setting = Settings::retrieveZ(request);
-            const auto [machine_width, machine_depth] = Settings::machineSize(request);
-
-            if (! pattern_setting.has_value() || ! infill_scale_setting.has_value() || ! infill_directory_setting.has_value() || ! center_x_setting.has_value() || ! center_y_setting.has_value() || ! machine_width.has_value() || ! machine_depth.has_value() || ! z_setting.has_value())
-            {
-                spdlog::error(
-                    "pattern: {}, infill scale: {}, infill directory: {}, center distance x: {}, center distance y: {}, machine width: {}, machine depth: {}, z: {}",
+            auto call = std::make_shared<Call>();
+            // Must be set up before the call starts. The callback keeps the call alive, since it may fire after handle() returned.
+            // It runs on the GrpcContext like handle(), which is where the cancellation signal may be emitted.
+            agrpc::notify_when_done(
+                grpc_context,
+                call->server_context,
+                [call]
+                {
+                    if (call->server_context.IsCancelled())
+                    {
+                        call->cancellation.cancel();
+                        call->cancel_queued.emit(boost::asio::cancellation_type::terminal);
+                    }
+                });
+            co_await agrpc::request(&T::RequestCall, *generate_service, call->server_context, call->request, call->writer, boost::asio::use_awaitable);
+            // Each call continues in its own coroutine, so further requests are accepted while it waits for a worker.
+            boost::asio::co_spawn(co_await boost::asio::this_coro::executor, handle(std::move(call)), boost::asio::detached);
+        }
+    }
+
+    struct Call
+    {
+        grpc::ServerContext server_context;
+        Req request;
+        grpc::ServerAsyncResponseWriter<Rsp> writer{ &server_context };
+        infill::CancellationToken cancellation;
+        boost::asio::cancellation_signal cancel_queued; //!< Takes the request out of the scheduler queue while it waits
+    };
+
+    boost::asio::awaitable<void> handle(std::shared_ptr<Call> call)
+    {
+        auto& server_context = call->server_context;
+        auto& request = call->request;
+        auto& writer = call->writer;
+        call->cancellation.setDeadline(server_context.deadline());
+        const auto arrived_at = infill::LatencyBudget::clock_t::now();
+        grpc::Status status = grpc::Status::OK;
+        const auto pattern_setting = Settings::getPattern(request.pattern(), metadata->plugin_name, metadata->plugin_version);
+        const auto infill_scale_setting = Settings::retrieveSettings("infill_scale", request, metadata);
+        const auto infill_directory_setting = Settings::retrieveSettings("infill_directory", request, metadata);
+        const auto center_x_setting = Settings::retrieveSettings("center_x", request, metadata);
+        const auto center_y_setting = Settings::retrieveSettings("center_y", request, metadata);
+        const auto path_order_setting = Settings::retrieveSettings("infill_path_order", request, metadata);
+        const auto time_budget_setting = Settings::retrieveSettings("infill_time_budget", request, metadata);
+        const auto z_setting = Settings::retrieveZ(request);
+        const auto [machine_width, machine_depth] = Settings::machineSize(request);
+
+        if (! pattern_setting.has_value() || ! infill_scale_setting.has_value() || ! infill_directory_setting.has_value() || ! center_x_setting.has_value() || ! center_y_setting.has_value() || ! machine_width.has_value() || ! machine_depth.has_value() || ! z_setting.has_value())
+        {
+            spdlog::error(
+                "pattern: {}, infill scale: {}, infill directory: {}, center distance x: {}, center distance y: {}, machine width: {}, machine depth: {}, z: {}",
+                pattern_setting.has_value(),
+                infill_scale_setting.has_value(),
+                infill_directory_setting.has_value(),
+                center_x_setting.has_value(),
+                center_y_setting.has_value(),
+                machine_width.has_value(),
+                machine_depth.has_value(),
+                z_setting.has_value());
+            spdlog::error(request.DebugString());
+            status = grpc::Status(
+                grpc::StatusCode::INTERNAL,
+                fmt::format(
+                    "Plugin could not retrieve settings! pattern: {}, infill scale: {}, infill directory: {}, center distance x: {}, center distance y: {}, machine width: {}, machine depth: {}, z: {}",
                     pattern_setting.has_value(),
                     infill_scale_setting.has_value(),
                     infill_directory_setting.has_value(),
@@ -97,104 +169,268 @@ struct Generate
                     center_y_setting.has_value(),
                     machine_width.has_value(),
                     machine_depth.has_value(),
-                    z_setting.has_value());
-                spdlog::error(request.DebugString());
-                status = grpc::Status(
-                    grpc::StatusCode::INTERNAL,
-                    fmt::format(
-                        "Plugin could not retrieve settings! pattern: {}, infill scale: {}, infill directory: {}, center distance x: {}, center distance y: {}, machine width: {}, machine depth: {}, z: {}",
-                        pattern_setting.has_value(),
-                        infill_scale_setting.has_value(),
-                        infill_directory_setting.has_value(),
-                        center_x_setting.has_value(),
-                        center_y_setting.has_value(),
-                        machine_width.has_value(),
-                        machine_depth.has_value(),
-                        z_setting.has_value()));
-            }
+                    z_setting.has_value()));
+        }
 
-            if (! status.ok())
-            {
-                co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
-                continue;
-            }
+        if (! status.ok())
+        {
+            co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
+            co_return;
+        }
 
-            const int64_t infill_scale = std::stold(infill_scale_setting.value());
-                generator.tiles_path = infill_directory_setting.value();
-            const int64_t center_x = (long long) (1000.0 * (std::stold(machine_width.value()) / 2.0 + std::stold(center_x_setting.value())));
-            const int64_t center_y = (long long) (1000.0 * (std::stold(machine_depth.value()) / 2.0 - std::stold(center_y_setting.value())));
-            const int64_t z = std::stoll(z_setting.value());
-            auto client_metadata = getUuid(server_context);
+        // Optional, engines built against a definition without the setting get the paths in clipping order.
+        const bool path_order = path_order_setting.has_value() && (path_order_setting.value() == "True" || path_order_setting.value() == "true");
+        int64_t infill_scale{ 0 };
+        int64_t center_x{ 0 };
+        int64_t center_y{ 0 };
+        int64_t z{ 0 };
+        infill::LatencyBudget budget;
+        std::string tenant;
+        try
+        {
+            infill_scale = static_cast<int64_t>(number("infill_scale", infill_scale_setting.value()));
+            std::tie(center_x, center_y) = infill::InfillGenerator::infillCenter(
+                number("machine_width", machine_width.value()),
+                number("machine_depth", machine_depth.value()),
+                number("center_x", center_x_setting.value()),
+                number("center_y", center_y_setting.value()));
+            z = static_cast<int64_t>(number("z", z_setting.value()));
+            budget = latencyBudget(arrived_at, time_budget_setting, server_context.deadline());
+            tenant = getUuid(server_context);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            spdlog::error("Rejected request: {}", e.what());
+            status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, e.what());
+        }
+        catch (const std::exception& e)
+        {
+            status = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+        }
+        if (! status.ok())
+        {
+            co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
+            co_return;
+        }
+        // Marks the broadcast session of the engine as in use, so it is not evicted while the engine slices.
+        if (! settings->touch(tenant))
+        {
+            spdlog::debug("No broadcast settings of engine {}", tenant);
+        }
 
-            auto outlines = std::vector<infill::geometry::polygon_outer<>>{};
-            for (const auto& msg_outline : request.infill_areas().polygons())
-            {
-                auto outline = infill::geometry::polygon_outer<>{};
-                for (const auto& point : msg_outline.outline().path())
-                {
-                    outline.push_back({ point.x(), point.y() });
-                }
-                outlines.push_back(outline);
-                for (const auto& hole : msg_outline.holes())
-                {
-                    auto hole_outline = infill::geometry::polygon_outer<>{};
-                    for (const auto& point : hole.path())
-                    {
-                        hole_outline.push_back({ point.x(), point.y() });
-                    }
-                    outlines.push_back(hole_outline);
-                }
-            }
+        const auto outlines = toIslands(request.infill_areas().polygons());
 
-            Rsp response;
+        // Starts resolving and reading the layer file now, while the call waits in the queue of the scheduler.
+        const auto prepared = prepareLayer(infill_directory_setting.value(), std::string{ pattern_setting.value() }, z);
 
-            ClipperLib::Paths lines;
-            ClipperLib::Paths polys;
-            try
-            {
-                auto [lines_, polys_] = generator.generate(outlines, pattern_setting.value(), infill_scale, center_x, center_y, z);
-                lines = std::move(lines_);
-                polys = std::move(polys_);
-            }
-            catch (const std::exception& e)
+        Rsp response;
+        std::size_t response_bytes{ 0 };
+        std::function<void()> job = [&]()
+        {
+            const infill::AllocRequest alloc_request{ "request" };
+            // Only waits when the worker got to the call before the file system did, rethrows a failed resolution.
+            const auto& content_path = prepared.get();
+            const auto result = generator.generate(content_path, outlines, infill_scale, center_x, center_y, z, call->cancellation, &budget, tenant);
+            const infill::AllocStage alloc_stage{ "response" };
+            if (path_order)
             {
-                spdlog::error("Error: {}", e.what());
-                status = grpc::Status(grpc::StatusCode::INTERNAL, static_cast<std::string>(e.what()));
+                toResponse(infill::geometry::orderPaths(result), response);
             }
-            if (! status.ok())
+            else
             {
-                co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
-                continue;
+                toResponse(result, response);
             }
+            // Computed here on the worker, serializing caches the size, so gRPC does not walk the message again.
+            response_bytes = response.ByteSizeLong();
+        };
+        try
+        {
+            call->cancellation.check();
+            co_await scheduler->submit(tenant, std::move(job), boost::asio::bind_cancellation_slot(call->cancel_queued.slot(), boost::asio::use_awaitable));
+        }
+        catch (const infill::DeadlineExceeded& e)
+        {
+            spdlog::info("Stopped request of engine {}: {}", tenant, e.what());
+            status = grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, e.what());
+        }
+        catch (const infill::Cancelled& e)
+        {
+            spdlog::info("Stopped request of engine {}: {}", tenant, e.what());
+            status = grpc::Status(grpc::StatusCode::CANCELLED, e.what());
+        }
+        catch (const QueueFull& e)
+        {
+            spdlog::warn("Rejected request of engine {}: {}", tenant, e.what());
+            status = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, e.what());
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::error("Error: {}", e.what());
+            status = grpc::Status(grpc::StatusCode::INTERNAL, static_cast<std::string>(e.what()));
+        }
+        if (! status.ok())
+        {
+            co_await agrpc::finish_with_error(writer, status, boost::asio::use_awaitable);
+            co_return;
+        }
+        scheduler->metrics()->recordPayload(tenant, request.ByteSizeLong(), response_bytes);
+        if (compression_threshold > 0 && response_bytes > compression_threshold && acceptsEncoding(server_context, "gzip"))
+        {
+            // Most of the response are varint coordinates of neighbouring points, which deflate compresses well.
+            server_context.set_compression_algorithm(GRPC_COMPRESS_GZIP);
+        }
+        if (budget.quality != infill::Quality::full)
+        {
+            spdlog::warn("Served layer {} of engine {} at {} quality to stay within its latency budget", z, tenant, infill::qualityNames(budget.quality));
+            scheduler->metrics()->recordDegraded(tenant, budget.quality);
+        }
+
+        co_await agrpc::finish(writer, response, status, boost::asio::use_awaitable);
+    }
 
-            // convert poly_lines to protobuf response
-            auto* poly_lines_msg = response.mutable_poly_lines();
-            for (auto& poly_line : lines)
+    /*! Resolve the layer file on the reader threads and read it ahead unless its tile is cached, the future completes
+     * with the path once the content was handed to the tile cache
+     *
+     * Resolving the layer scans the tile directory and the cache stats the file. On a slow or network mount either would
+     * stall every call on the event loop, so none of it runs on the calling thread.
+     */
+    std::shared_future<std::filesystem::path> prepareLayer(std::filesystem::path directory, std::string pattern, int64_t z) const
+    {
+        auto promise = std::make_shared<std::promise<std::filesystem::path>>();
+        auto prepared = promise->get_future().share();
+        file_reader->post(
+            [promise, directory = std::move(directory), pattern = std::move(pattern), z, tile_cache = generator.tile_cache, reader = file_reader]
             {
-                auto* path_msg = poly_lines_msg->add_paths();
-                for (auto& point : poly_line)
+                std::filesystem::path content_path;
+                infill::FileStamp stamp;
+                try
+                {
+                    content_path = infill::InfillGenerator::layerFile(directory, pattern, z);
+                    if (! tile_cache || ! tile_cache->wantsContent(content_path))
+                    {
+                        promise->set_value(content_path);
+                        return;
+                    }
+                    stamp = infill::FileStamp::of(content_path);
+                }
+                catch (...)
                 {
-                    auto* point_msg = path_msg->add_path();
-                    point_msg->set_x(point.X);
-                    point_msg->set_y(point.Y);
+                    promise->set_exception(std::current_exception());
+                    return;
                 }
-            }
-
-            auto* polygons_msg = response.mutable_polygons();
+                reader->read(
+                    content_path,
+                    [promise, content_path, stamp, tile_cache](std::exception_ptr error, std::string content)
+                    {
+                        if (error == nullptr)
+                        {
+                            tile_cache->provideContent(content_path, stamp, std::move(content));
+                        }
+                        else
+                        {
+                            // The generator reads the file itself and reports the error, if it persists.
+                            try
+                            {
+                                std::rethrow_exception(error);
+                            }
+                            catch (const std::exception& e)
+                            {
+                                spdlog::warn("Could not read {} ahead: {}", content_path.string(), e.what());
+                            }
+                        }
+                        promise->set_value(content_path);
+                    });
+            });
+        return prepared;
+    }
 
-            for (const auto& pp : polys)
+    /*! Whether the client listed the encoding in its grpc-accept-encoding header */
+    static bool acceptsEncoding(const grpc::ServerContext& server_context, std::string_view encoding)
+    {
+        const auto [first, last] = server_context.client_metadata().equal_range("grpc-accept-encoding");
+        for (auto it = first; it != last; ++it)
+        {
+            std::string_view accepted{ it->second.data(), it->second.size() };
+            while (! accepted.empty())
             {
-                auto* path_msg = polygons_msg->add_polygons()->mutable_outline();
-                for (const auto& point : pp)
+                const auto separator = accepted.find(',');
+                auto token = accepted.substr(0, separator);
+                while (token.starts_with(' '))
                 {
-                    auto* point_msg = path_msg->add_path();
-                    point_msg->set_x(point.X);
-                    point_msg->set_y(point.Y);
+                    token.remove_prefix(1);
                 }
+                while (token.ends_with(' '))
+                {
+                    token.remove_suffix(1);
+                }
+                if (token == encoding)
+                {
+                    return true;
+                }
+                accepted = separator == std::string_view::npos ? std::string_view{} : accepted.substr(separator + 1);
             }
+        }
+        return false;
+    }
 
-            co_await agrpc::finish(writer, response, status, boost::asio::use_awaitable);
+    /*! The budget of a request, the time budget setting [ms] and most of the time left until the gRPC deadline
+     *
+     * A fifth of the time to the deadline is kept back for the clip that runs after the estimate and for the response.
+     * Without either limit the budget is unlimited and the generator always produces the full quality.
+     */
+    static infill::LatencyBudget latencyBudget(infill::LatencyBudget::clock_t::time_point arrived_at, const std::optional<std::string>& time_budget_setting, std::chrono::system_clock::time_point deadline)
+    {
+        infill::LatencyBudget budget;
+        if (time_budget_setting.has_value())
+        {
+            const auto milliseconds = number("infill_time_budget", time_budget_setting.value());
+            if (milliseconds > 0)
+            {
+                budget.deadline = arrived_at + std::chrono::duration_cast<infill::LatencyBudget::clock_t::duration>(std::chrono::duration<double, std::milli>{ milliseconds });
+            }
+        }
+        if (deadline != std::chrono::system_clock::time_point::max())
+        {
+            const auto left = deadline - std::chrono::system_clock::now();
+            budget.deadline = std::min(budget.deadline, arrived_at + std::chrono::duration_cast<infill::LatencyBudget::clock_t::duration>(left * 4 / 5));
         }
+        return budget;
+    }
+
+    /*! A numeric setting, throws std::invalid_argument naming the setting when it is malformed or out of range */
+    static long double number(std::string_view name, const std::string& value)
+    {
+        try
+        {
+            const auto parsed = std::stold(value);
+            // Every setting ends up in an int64_t, outside of its range the conversion is undefined.
+            if (std::isfinite(parsed) && std::abs(parsed) < static_cast<long double>(std::numeric_limits<int64_t>::max()))
+            {
+                return parsed;
+            }
+        }
+        catch (const std::logic_error&)
+        {
+        }
+        throw std::invalid_argument(fmt::format("Setting {} is not a valid number: '{}'", name, value));
+    }
+
+    static void toResponse(const infill::geometry::path_store<>& result, Rsp& response)
+    {
+        auto* poly_lines_msg = response.mutable_poly_lines();
+        addPaths(
+            result.polylines(),
+            [poly_lines_msg]
+            {
+                return poly_lines_msg->add_paths();
+            });
+        auto* polygons_msg = response.mutable_polygons();
+        addPaths(
+            result.polygons(),
+            [polygons_msg]
+            {
+                return polygons_msg->add_polygons()->mutable_outline();
+            });
     }
 };
 
@@ -0,0 +1,264 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_GENERATE_LAYERS_H
+#define PLUGIN_GENERATE_LAYERS_H
+
+#include "infill/alloc_profiler.h"
+#include "infill/cancellation.h"
+#include "infill/infill_generator.h"
+#include "infill/islands.h"
+#include "infill/path_order.h"
+#include "layered_infill/v0/generate_layers.grpc.pb.h"
+#include "layered_infill/v0/generate_layers.pb.h"
+#include "plugin/messages.h"
+#include "plugin/scheduler.h"
+
+#include <agrpc/asio_grpc.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/bind_cancellation_slot.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/cancellation_signal.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <spdlog/spdlog.h>
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#elif __has_include(<experimental/coroutine>)
+#include <experimental/coroutine>
+#define USE_EXPERIMENTAL_COROUTINE
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace plugin
+{
+
+/*! Server-streaming generate service for batch clients, many layers per call
+ *
+ * The client sends the infill parameters and the outlines of all its layers at once. The layers are generated on the
+ * scheduler, at most max_in_flight at a time, and every result is written to the stream as soon as it is done. A new
+ * layer is only started once the result of a finished one was handed to gRPC, so a slow reader holds back generation
+ * and the memory of a call stays bounded by max_in_flight results.
+ */
+struct GenerateLayers
+{
+    using service_t = std::shared_ptr<layered_infill::v0::GenerateLayersService::AsyncService>;
+    service_t generate_layers_service{ std::make_shared<layered_infill::v0::GenerateLayersService::AsyncService>() };
+    infill::InfillGenerator generator;
+    std::shared_ptr<FairScheduler> scheduler{ std::make_shared<FairScheduler>() };
+    std::size_t max_in_flight{ 8 }; //!< Must not exceed the queue depth of the scheduler
+
+    boost::asio::awaitable<void> run(agrpc::GrpcContext& grpc_context)
+    {
+        while (true)
+        {
+            auto call = std::make_shared<Call>();
+            agrpc::notify_when_done(
+                grpc_context,
+                call->server_context,
+                [call]
+                {
+                    if (call->server_context.IsCancelled())
+                    {
+                        cancel(*call);
+                    }
+                });
+            co_await agrpc::request(
+                &layered_infill::v0::GenerateLayersService::AsyncService::RequestGenerateLayers,
+                *generate_layers_service,
+                call->server_context,
+                call->request,
+                call->writer,
+                boost::asio::use_awaitable);
+            boost::asio::co_spawn(co_await boost::asio::this_coro::executor, handle(std::move(call)), boost::asio::detached);
+        }
+    }
+
+    struct Call
+    {
+        grpc::ServerContext server_context;
+        layered_infill::v0::GenerateLayersRequest request;
+        grpc::ServerAsyncWriter<layered_infill::v0::LayerResult> writer{ &server_context };
+        infill::CancellationToken cancellation;
+        std::vector<boost::asio::cancellation_signal> cancel_queued; //!< Per slot, takes its layer out of the scheduler queue
+    };
+
+    /*! Stop the layers of the call, the running ones through the token and the queued ones through their slots */
+    static void cancel(Call& call)
+    {
+        call.cancellation.cancel();
+        for (auto& signal : call.cancel_queued)
+        {
+            signal.emit(boost::asio::cancellation_type::terminal);
+        }
+    }
+
+    boost::asio::awaitable<void> handle(std::shared_ptr<Call> call)
+    {
+        const auto& request = call->request;
+        call->cancellation.setDeadline(call->server_context.deadline());
+        const auto layer_count = static_cast<std::size_t>(request.layers_size());
+        if (request.machine_width() <= 0 || request.machine_depth() <= 0 || request.infill_scale() <= 0)
+        {
+            co_await agrpc::finish(call->writer, grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "machine size and infill scale must be positive"), boost::asio::use_awaitable);
+            co_return;
+        }
+
+        // Batch clients are not engines, a client without an engine uuid is told apart by its connection.
+        const auto uuid = call->server_context.client_metadata().find("cura-engine-uuid");
+        const auto tenant = uuid != call->server_context.client_metadata().end() ? std::string{ uuid->second.data(), uuid->second.size() } : call->server_context.peer();
+        const auto center = infill::InfillGenerator::infillCenter(request.machine_width(), request.machine_depth(), request.center_x(), request.center_y());
+        spdlog::info("Generating {} layers for {}", layer_count, tenant);
+
+        // Every layer in flight owns a slot, finished layers report their slot through the channel.
+        const auto slot_count = std::max<std::size_t>(std::min(max_in_flight, layer_count), 1);
+        std::vector<layered_infill::v0::LayerResult> slots(slot_count);
+        std::vector<std::exception_ptr> errors(slot_count);
+        std::vector<std::size_t> free_slots(slot_count);
+        for (std::size_t slot = 0; slot < slot_count; ++slot)
+        {
+            free_slots[slot] = slot_count - 1 - slot;
+        }
+        call->cancel_queued = std::vector<boost::asio::cancellation_signal>(slot_count);
+        auto executor = co_await boost::asio::this_coro::executor;
+        boost::asio::experimental::channel<void(boost::system::error_code, std::size_t)> finished{ executor, slot_count };
+
+        std::size_t next_layer{ 0 };
+        std::size_t in_flight{ 0 };
+        grpc::Status status = grpc::Status::OK;
+        while (in_flight > 0 || (next_layer < layer_count && status.ok()))
+        {
+            while (next_layer < layer_count && ! free_slots.empty() && status.ok())
+            {
+                const auto slot = free_slots.back();
+                free_slots.pop_back();
+                auto& result = slots[slot];
+                result.Clear();
+                result.set_z(request.layers(static_cast<int>(next_layer)).z());
+                std::function<void()> job = [this, call, center, &layer = request.layers(static_cast<int>(next_layer)), &result, tenant]()
+                {
+                    const infill::AllocRequest alloc_request{ "request" };
+                    generateLayer(*call, layer, center, tenant, result);
+                };
+                scheduler->submit(
+                    tenant,
+                    std::move(job),
+                    boost::asio::bind_cancellation_slot(
+                        call->cancel_queued[slot].slot(),
+                        boost::asio::bind_executor(
+                            executor,
+                            [slot, &finished, &errors](std::exception_ptr error)
+                            {
+                                errors[slot] = error;
+                                finished.try_send(boost::system::error_code{}, slot);
+                            })));
+                ++next_layer;
+                ++in_flight;
+            }
+
+            const auto slot = co_await finished.async_receive(boost::asio::use_awaitable);
+            --in_flight;
+            auto& result = slots[slot];
+            if (status.ok())
+            {
+                status = layerStatus(std::exchange(errors[slot], nullptr), result);
+            }
+            if (status.ok())
+            {
+                if (! result.error().empty())
+                {
+                    spdlog::warn("Layer {} of {} failed: {}", result.z(), tenant, result.error());
+                }
+                if (! co_await agrpc::write(call->writer, result, boost::asio::use_awaitable))
+                {
+                    // The client is gone, the layers still running are stopped and awaited before the call ends.
+                    status = grpc::Status(grpc::StatusCode::CANCELLED, "The client closed the stream");
+                    cancel(*call);
+                }
+            }
+            else
+            {
+                cancel(*call);
+            }
+            result.Clear();
+            free_slots.push_back(slot);
+        }
+        co_await agrpc::finish(call->writer, status, boost::asio::use_awaitable);
+    }
+
+    /*! The status ending the call after a layer failed, a layer failing on its own only sets the error of its result */
+    static grpc::Status layerStatus(std::exception_ptr error, layered_infill::v0::LayerResult& result)
+    {
+        if (error == nullptr)
+        {
+            return grpc::Status::OK;
+        }
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const infill::DeadlineExceeded& e)
+        {
+            return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, e.what());
+        }
+        catch (const infill::Cancelled& e)
+        {
+            return grpc::Status(grpc::StatusCode::CANCELLED, e.what());
+        }
+        catch (const QueueFull& e)
+        {
+            return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, e.what());
+        }
+        catch (const std::exception& e)
+        {
+            result.clear_poly_lines();
+            result.clear_polygons();
+            result.set_error(e.what());
+        }
+        return grpc::Status::OK;
+    }
+
+    /*! Generate one layer on a worker, errors of the layer end up in the error of its result */
+    void generateLayer(const Call& call, const layered_infill::v0::Layer& layer, const std::pair<int64_t, int64_t>& center, const std::string& tenant, layered_infill::v0::LayerResult& result) const
+    {
+        const auto& request = call.request;
+        const auto outlines = toIslands(layer.outlines());
+
+        const auto content_path = infill::InfillGenerator::layerFile(request.infill_directory(), request.pattern(), layer.z());
+        auto paths = generator.generate(content_path, outlines, request.infill_scale(), center.first, center.second, layer.z(), call.cancellation, nullptr, tenant);
+        if (request.infill_path_order())
+        {
+            paths = infill::geometry::orderPaths(paths);
+        }
+
+        const infill::AllocStage alloc_stage{ "response" };
+        addPaths(
+            paths.polylines(),
+            [&result]
+            {
+                return result.add_poly_lines();
+            });
+        addPaths(
+            paths.polygons(),
+            [&result]
+            {
+                return result.add_polygons();
+            });
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_GENERATE_LAYERS_H
@@ -0,0 +1,57 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_MESSAGES_H
+#define PLUGIN_MESSAGES_H
+
+#include "infill/islands.h"
+
+namespace plugin
+{
+
+/*! The islands of repeated polygon messages, every message is one island of an outline and its holes
+ *
+ * The outlines are built in place, they are handed to Clipper as they are.
+ */
+infill::geometry::Islands toIslands(const auto& polygons)
+{
+    infill::geometry::Islands islands;
+    for (const auto& msg_outline : polygons)
+    {
+        auto& outline = islands.addOutline();
+        outline.reserve(msg_outline.outline().path_size());
+        for (const auto& point : msg_outline.outline().path())
+        {
+            outline.push_back({ point.x(), point.y() });
+        }
+        for (const auto& hole : msg_outline.holes())
+        {
+            auto& hole_outline = islands.addHole();
+            hole_outline.reserve(hole.path_size());
+            for (const auto& point : hole.path())
+            {
+                hole_outline.push_back({ point.x(), point.y() });
+            }
+        }
+    }
+    return islands;
+}
+
+/*! Write the points of every path to the path message add_path returns for it */
+void addPaths(const auto& paths, auto&& add_path)
+{
+    for (const auto& path : paths)
+    {
+        auto* path_msg = add_path();
+        for (const auto& point : path)
+        {
+            auto* point_msg = path_msg->add_path();
+            point_msg->set_x(point.X);
+            point_msg->set_y(point.Y);
+        }
+    }
+}
+
+} // namespace plugin
+
+#endif // PLUGIN_MESSAGES_H
@@ -0,0 +1,257 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_METRICS_H
+#define PLUGIN_METRICS_H
+
+#include "infill/latency_budget.h"
+#include "infill/perf_counters.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace plugin
+{
+
+constexpr double mebibyte{ 1024.0 * 1024.0 };
+
+/*! Latency distribution in fixed logarithmic millisecond buckets */
+struct LatencyHistogram
+{
+    static constexpr std::array<double, 14> bounds{ 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000 };
+
+    std::uint64_t count{ 0 };
+    double sum_ms{ 0 };
+    double max_ms{ 0 };
+    std::array<std::uint64_t, bounds.size() + 1> buckets{};
+
+    void record(std::chrono::nanoseconds duration) noexcept
+    {
+        const auto ms = std::chrono::duration<double, std::milli>(duration).count();
+        ++count;
+        sum_ms += ms;
+        max_ms = std::max(max_ms, ms);
+        ++buckets[static_cast<std::size_t>(std::lower_bound(bounds.begin(), bounds.end(), ms) - bounds.begin())];
+    }
+
+    /*! Upper bound of the bucket holding the given quantile */
+    [[nodiscard]] double quantile(double q) const noexcept
+    {
+        const auto rank = static_cast<std::uint64_t>(q * static_cast<double>(count));
+        std::uint64_t seen{ 0 };
+        for (std::size_t i = 0; i < bounds.size(); ++i)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+            {
+                return bounds[i];
+            }
+        }
+        return max_ms;
+    }
+
+    [[nodiscard]] double mean() const noexcept
+    {
+        return count == 0 ? 0.0 : sum_ms / static_cast<double>(count);
+    }
+};
+
+/*! Sizes of serialized messages */
+struct PayloadStats
+{
+    std::uint64_t count{ 0 };
+    std::uint64_t sum{ 0 };
+    std::uint64_t max{ 0 };
+
+    void record(std::size_t bytes) noexcept
+    {
+        ++count;
+        sum += bytes;
+        max = std::max<std::uint64_t>(max, bytes);
+    }
+
+    [[nodiscard]] double meanMiB() const noexcept
+    {
+        return count == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(count) / mebibyte;
+    }
+
+    [[nodiscard]] double maxMiB() const noexcept
+    {
+        return static_cast<double>(max) / mebibyte;
+    }
+};
+
+/*! Request metrics per tenant, a tenant being one CuraEngine instance identified by its cura-engine-uuid
+ *
+ * The figures are written to the log every interval and once more on shutdown. Tenants without a request for longer
+ * than the idle time are dropped after a report, so engines that went away do not accumulate in a long running daemon.
+ */
+class Metrics
+{
+public:
+    /*! Responses larger than the given fraction of the message limit are reported, a limit of 0 disables the warning */
+    static constexpr double message_warning_ratio{ 0.8 };
+
+    explicit Metrics(std::chrono::seconds interval = std::chrono::seconds{ 60 }, std::size_t message_limit = 0, std::chrono::seconds idle = std::chrono::seconds{ 3600 })
+        : interval_{ interval }
+        , message_limit_{ message_limit }
+        , idle_{ idle }
+    {
+    }
+
+    void recordRequest(std::string_view tenant, std::chrono::nanoseconds queued, std::chrono::nanoseconds run, bool ok)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto& stats = statsOf(tenant);
+        stats.queued.record(queued);
+        stats.run.record(run);
+        if (! ok)
+        {
+            ++stats.failed;
+        }
+    }
+
+    /*! Serialized size of a request and its response */
+    void recordPayload(std::string_view tenant, std::size_t request_bytes, std::size_t response_bytes)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto& stats = statsOf(tenant);
+        stats.request_bytes.record(request_bytes);
+        stats.response_bytes.record(response_bytes);
+        if (message_limit_ > 0 && static_cast<double>(response_bytes) > message_warning_ratio * static_cast<double>(message_limit_))
+        {
+            ++stats.near_limit;
+        }
+    }
+
+    /*! Count a result served below full quality to stay within its latency budget, once for each of its reductions */
+    void recordDegraded(std::string_view tenant, infill::Quality quality)
+    {
+        std::scoped_lock lock{ mutex_ };
+        auto& stats = statsOf(tenant);
+        for (std::size_t i = 0; i < infill::degradations.size(); ++i)
+        {
+            if (infill::includes(quality, infill::degradations[i]))
+            {
+                ++stats.degraded[i];
+            }
+        }
+    }
+
+    void recordRejected(std::string_view tenant)
+    {
+        std::scoped_lock lock{ mutex_ };
+        ++statsOf(tenant).rejected;
+    }
+
+    /*! Write the metrics to the log if the report interval has passed since the last report */
+    void maybeReport()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        {
+            std::scoped_lock lock{ mutex_ };
+            if (now - last_report_ < interval_)
+            {
+                return;
+            }
+            last_report_ = now;
+        }
+        report();
+
+        // Idle tenants had their final figures in this report.
+        std::scoped_lock lock{ mutex_ };
+        const auto dropped = std::erase_if(
+            tenants_,
+            [this, now](const auto& entry)
+            {
+                return now - entry.second.last_seen > idle_;
+            });
+        if (dropped > 0)
+        {
+            spdlog::debug("[metrics] dropped {} idle tenants", dropped);
+        }
+    }
+
+    void report() const
+    {
+        std::scoped_lock lock{ mutex_ };
+        for (const auto& [tenant, stats] : tenants_)
+        {
+            spdlog::info(
+                "[metrics] tenant {}: requests: {}, failed: {}, rejected: {}, degraded (simplified/culled/nearby layer): {}/{}/{}, queued ms (mean/p50/p99/max): {:.1f}/{}/{}/{:.1f}, run ms (mean/p50/p99/max): {:.1f}/{}/{}/{:.1f}",
+                tenant,
+                stats.run.count,
+                stats.failed,
+                stats.rejected,
+                stats.degraded[0],
+                stats.degraded[1],
+                stats.degraded[2],
+                stats.queued.mean(),
+                stats.queued.quantile(0.5),
+                stats.queued.quantile(0.99),
+                stats.queued.max_ms,
+                stats.run.mean(),
+                stats.run.quantile(0.5),
+                stats.run.quantile(0.99),
+                stats.run.max_ms);
+            spdlog::info(
+                "[metrics] tenant {}: request MiB (mean/max): {:.2f}/{:.2f}, response MiB (mean/max): {:.2f}/{:.2f}",
+                tenant,
+                stats.request_bytes.meanMiB(),
+                stats.request_bytes.maxMiB(),
+                stats.response_bytes.meanMiB(),
+                stats.response_bytes.maxMiB());
+            if (stats.near_limit > 0)
+            {
+                spdlog::warn(
+                    "[metrics] tenant {}: {} responses above {:.0f}% of the message limit of {:.0f} MiB, raise --max_message_size before they fail",
+                    tenant,
+                    stats.near_limit,
+                    message_warning_ratio * 100.0,
+                    static_cast<double>(message_limit_) / mebibyte);
+            }
+        }
+        infill::PerfCounters::global().report();
+    }
+
+private:
+    struct TenantStats
+    {
+        LatencyHistogram queued;
+        LatencyHistogram run;
+        std::uint64_t failed{ 0 };
+        std::uint64_t rejected{ 0 };
+        std::array<std::uint64_t, infill::degradations.size()> degraded{}; //!< Per reduction, see infill::degradations
+        PayloadStats request_bytes;
+        PayloadStats response_bytes;
+        std::uint64_t near_limit{ 0 };
+        std::chrono::steady_clock::time_point last_seen;
+    };
+
+    std::chrono::seconds interval_;
+    std::size_t message_limit_;
+    std::chrono::seconds idle_;
+    std::chrono::steady_clock::time_point last_report_{ std::chrono::steady_clock::now() };
+    mutable std::mutex mutex_;
+    std::map<std::string, TenantStats> tenants_;
+
+    TenantStats& statsOf(std::string_view tenant)
+    {
+        auto& stats = tenants_[std::string{ tenant }];
+        stats.last_seen = std::chrono::steady_clock::now();
+        return stats;
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_METRICS_H
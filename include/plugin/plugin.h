@@ -37,6 +37,7 @@
 
 #include "plugin/broadcast.h"
 #include "plugin/generate.h"
+#include "plugin/generate_layers.h"
 #include "plugin/handshake.h"
 #include "plugin/metadata.h"
 
@@ -50,6 +51,7 @@
 
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <utility>
 
@@ -63,9 +65,24 @@ public:
     std::optional<Broadcast> broadcast;
     std::shared_ptr<Metadata> metadata{ std::make_shared<Metadata>() };
 
+    /*! Listen on address:port, or on the Unix domain socket of an address given as unix:<path>, in which case the port is ignored */
     Plugin(std::string_view address, std::string_view port, std::shared_ptr<grpc::ServerCredentials> credentials)
     {
-        builder_.AddListeningPort(fmt::format("{}:{}", address, port.data()), std::move(credentials));
+        if (address.starts_with("unix:") || address.starts_with("unix-abstract:"))
+        {
+            builder_.AddListeningPort(std::string{ address }, std::move(credentials));
+        }
+        else
+        {
+            builder_.AddListeningPort(fmt::format("{}:{}", address, port.data()), std::move(credentials));
+        }
+    }
+
+    /*! Limit of sent and received messages, must be set before start(), gRPC only accepts 4 MiB by default */
+    void setMaxMessageSize(int bytes)
+    {
+        builder_.SetMaxReceiveMessageSize(bytes);
+        builder_.SetMaxSendMessageSize(bytes);
     }
 
     void addHandshakeService(Handshake&& service)
@@ -86,6 +103,13 @@ public:
         builder_.RegisterService(generate_.value().generate_service.get());
     }
 
+    /*! The streaming service of batch clients, CuraEngine only calls the generate service */
+    void addGenerateLayersService(GenerateLayers&& service)
+    {
+        generate_layers_ = std::move(service);
+        builder_.RegisterService(generate_layers_.value().generate_layers_service.get());
+    }
+
     void start()
     {
         server_ = builder_.BuildAndStart();
@@ -100,7 +124,11 @@ public:
         }
         if (generate_.has_value())
         {
-            boost::asio::co_spawn(context_, generate_.value().run(), boost::asio::detached);
+            boost::asio::co_spawn(context_, generate_.value().run(context_), boost::asio::detached);
+        }
+        if (generate_layers_.has_value())
+        {
+            boost::asio::co_spawn(context_, generate_layers_.value().run(context_), boost::asio::detached);
         }
         context_.run();
     }
@@ -117,6 +145,7 @@ private:
     std::unique_ptr<grpc::Server> server_;
     Handshake handshake_;
     std::optional<G> generate_;
+    std::optional<GenerateLayers> generate_layers_;
 };
 
 
@@ -0,0 +1,254 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_SCHEDULER_H
+#define PLUGIN_SCHEDULER_H
+
+#include "infill/cancellation.h"
+#include "plugin/metrics.h"
+
+#include <boost/asio/associated_cancellation_slot.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/cancellation_type.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace plugin
+{
+
+/*! Thrown into the awaiting request when its tenant already has the maximum number of requests queued */
+struct QueueFull : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+/*! Runs generate requests on a pool of worker threads, taking turns between tenants
+ *
+ * Every tenant has its own queue. Workers serve the tenants with queued work round-robin, one request per turn, so a
+ * tenant submitting a whole model at once cannot starve the interactive requests of other tenants. Each tenant may
+ * have at most max_queue_depth requests waiting; further requests are rejected with QueueFull. A request cancelled
+ * through the cancellation slot of its completion handler while it still waits is taken out of its queue and completes
+ * with infill::Cancelled at once, so it no longer counts against the queue depth.
+ */
+class FairScheduler
+{
+public:
+    explicit FairScheduler(std::size_t workers = 1, std::size_t max_queue_depth = 64, std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>())
+        : max_queue_depth_{ max_queue_depth }
+        , metrics_{ std::move(metrics) }
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(workers, 1); ++i)
+        {
+            workers_.emplace_back(
+                [this]
+                {
+                    work();
+                });
+        }
+    }
+
+    FairScheduler(const FairScheduler&) = delete;
+    FairScheduler& operator=(const FairScheduler&) = delete;
+
+    ~FairScheduler()
+    {
+        {
+            std::scoped_lock lock{ mutex_ };
+            stopped_ = true;
+        }
+        available_.notify_all();
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    [[nodiscard]] const std::shared_ptr<Metrics>& metrics() const noexcept
+    {
+        return metrics_;
+    }
+
+    /*! Queue fn for the tenant, completes with the exception thrown by fn, QueueFull, Cancelled, or no exception
+     *
+     * The completion handler is invoked on its associated executor, fn runs on a worker thread. Cancelling through the
+     * associated cancellation slot only has an effect before a worker picked fn up, a running fn has to watch its
+     * own cancellation token.
+     */
+    template<class CompletionToken>
+    auto submit(std::string tenant, std::function<void()> fn, CompletionToken&& token)
+    {
+        return boost::asio::async_initiate<CompletionToken, void(std::exception_ptr)>(
+            [this](auto handler, std::string tenant, std::function<void()> fn)
+            {
+                auto executor = boost::asio::get_associated_executor(handler);
+                auto slot = boost::asio::get_associated_cancellation_slot(handler);
+                auto completion = std::make_shared<decltype(handler)>(std::move(handler));
+                auto guard = std::make_shared<boost::asio::executor_work_guard<decltype(executor)>>(executor);
+                auto complete = [executor, slot, completion, guard](std::exception_ptr error)
+                {
+                    boost::asio::post(
+                        executor,
+                        [slot, completion, guard, error]() mutable
+                        {
+                            if (slot.is_connected())
+                            {
+                                slot.clear();
+                            }
+                            std::move(*completion)(error);
+                        });
+                };
+
+                std::unique_lock lock{ mutex_ };
+                auto& queue = queues_[tenant];
+                if (queue.size() >= max_queue_depth_)
+                {
+                    lock.unlock();
+                    metrics_->recordRejected(tenant);
+                    complete(std::make_exception_ptr(QueueFull{ "Too many queued requests for this engine" }));
+                    return;
+                }
+                if (queue.empty())
+                {
+                    ring_.push_back(tenant);
+                }
+                const auto id = next_id_++;
+                queue.push_back({ .id = id, .fn = std::move(fn), .complete = std::move(complete), .queued_at = std::chrono::steady_clock::now() });
+                lock.unlock();
+                // The slot is only used on the executor of the handler, where it is cleared again before completion.
+                if (slot.is_connected())
+                {
+                    slot.assign(
+                        [this, tenant, id](boost::asio::cancellation_type type)
+                        {
+                            if (type != boost::asio::cancellation_type::none)
+                            {
+                                cancelQueued(tenant, id);
+                            }
+                        });
+                }
+                available_.notify_one();
+            },
+            token,
+            std::move(tenant),
+            std::move(fn));
+    }
+
+private:
+    struct Job
+    {
+        std::uint64_t id;
+        std::function<void()> fn;
+        std::function<void(std::exception_ptr)> complete;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+
+    std::size_t max_queue_depth_;
+    std::shared_ptr<Metrics> metrics_;
+    std::mutex mutex_;
+    std::condition_variable available_;
+    std::unordered_map<std::string, std::deque<Job>> queues_;
+    std::deque<std::string> ring_; //!< Tenants with queued jobs, in the order they get their next turn
+    std::uint64_t next_id_{ 0 };
+    bool stopped_{ false };
+    std::vector<std::thread> workers_;
+
+    /*! Take a job that no worker picked up yet out of its queue and complete it with Cancelled */
+    void cancelQueued(const std::string& tenant, std::uint64_t id)
+    {
+        std::unique_lock lock{ mutex_ };
+        const auto queue = queues_.find(tenant);
+        if (queue == queues_.end())
+        {
+            return;
+        }
+        const auto job = std::find_if(
+            queue->second.begin(),
+            queue->second.end(),
+            [id](const Job& queued)
+            {
+                return queued.id == id;
+            });
+        if (job == queue->second.end())
+        {
+            return;
+        }
+        auto complete = std::move(job->complete);
+        queue->second.erase(job);
+        if (queue->second.empty())
+        {
+            queues_.erase(queue);
+            std::erase(ring_, tenant);
+        }
+        lock.unlock();
+        complete(std::make_exception_ptr(infill::Cancelled{ "Request was cancelled while queued" }));
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            std::unique_lock lock{ mutex_ };
+            available_.wait(
+                lock,
+                [this]
+                {
+                    return stopped_ || ! ring_.empty();
+                });
+            if (stopped_)
+            {
+                return;
+            }
+
+            auto tenant = std::move(ring_.front());
+            ring_.pop_front();
+            auto& queue = queues_[tenant];
+            auto job = std::move(queue.front());
+            queue.pop_front();
+            if (queue.empty())
+            {
+                queues_.erase(tenant);
+            }
+            else
+            {
+                ring_.push_back(tenant);
+            }
+            lock.unlock();
+
+            const auto started_at = std::chrono::steady_clock::now();
+            std::exception_ptr error;
+            try
+            {
+                job.fn();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            metrics_->recordRequest(tenant, started_at - job.queued_at, std::chrono::steady_clock::now() - started_at, error == nullptr);
+            metrics_->maybeReport();
+            job.complete(error);
+        }
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_SCHEDULER_H
@@ -0,0 +1,189 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+#ifndef PLUGIN_SETTINGS_STORE_H
+#define PLUGIN_SETTINGS_STORE_H
+
+#include "plugin/settings.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace plugin
+{
+
+/*! Broadcast settings per engine session, readable from any thread without waiting for a writer
+ *
+ * The sessions live in an immutable snapshot. A writer copies the current snapshot, applies its change and publishes
+ * the copy atomically, so a reader holding an older snapshot is never disturbed. Writers are rare, one per slice, and
+ * serialized among each other. Loading the snapshot is not lock-free: libstdc++ implements std::atomic<shared_ptr>
+ * with a short internal lock around the reference count, which readers and the publishing writer hold only for the
+ * pointer copy, never while the map is copied.
+ *
+ * A session counts as used when it is published, whenever find() returns it and when it is touched, which the generate
+ * service does for every request of its engine. Sessions unused for longer than the ttl are dropped when the next
+ * snapshot is published or, without writers, by the first find() or touch() after they expired. Beyond max_sessions the least recently used sessions
+ * are dropped on publish as well.
+ */
+class SettingsStore
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Session
+    {
+        Settings settings;
+        mutable std::atomic<clock_t::rep> last_used;
+
+        Session(Settings settings, clock_t::time_point now)
+            : settings{ std::move(settings) }
+            , last_used{ now.time_since_epoch().count() }
+        {
+        }
+    };
+
+    using snapshot_t = std::shared_ptr<const std::unordered_map<std::string, std::shared_ptr<const Session>>>;
+
+    explicit SettingsStore(std::chrono::seconds ttl = std::chrono::hours{ 1 }, std::size_t max_sessions = 256)
+        : ttl_{ ttl }
+        , max_sessions_{ std::max<std::size_t>(max_sessions, 1) }
+    {
+    }
+
+    /*! The current snapshot of all sessions */
+    [[nodiscard]] snapshot_t snapshot() const noexcept
+    {
+        return snapshot_.load(std::memory_order_acquire);
+    }
+
+    /*! The settings of the session, nullptr if it is unknown or was evicted, marks the session as used */
+    [[nodiscard]] std::shared_ptr<const Settings> find(const std::string& uuid)
+    {
+        const auto session = use(uuid);
+        if (session == nullptr)
+        {
+            return nullptr;
+        }
+        return { session, &session->settings };
+    }
+
+    /*! Mark the session as used without reading its settings, false if it is unknown or was evicted */
+    bool touch(const std::string& uuid)
+    {
+        return use(uuid) != nullptr;
+    }
+
+    void publish(const std::string& uuid, Settings settings)
+    {
+        const auto now = clock_t::now();
+        std::scoped_lock lock{ writer_mutex_ };
+        auto sessions = std::make_shared<std::unordered_map<std::string, std::shared_ptr<const Session>>>(*snapshot());
+        sessions->insert_or_assign(uuid, std::make_shared<const Session>(std::move(settings), now));
+        evict(*sessions, now);
+        store(std::move(sessions));
+    }
+
+    /*! Drop the sessions unused for longer than the ttl, readers calling this never wait for a publishing writer */
+    void expire()
+    {
+        std::unique_lock lock{ writer_mutex_, std::try_to_lock };
+        if (! lock.owns_lock())
+        {
+            return;
+        }
+        const auto now = clock_t::now();
+        auto sessions = std::make_shared<std::unordered_map<std::string, std::shared_ptr<const Session>>>(*snapshot());
+        const auto count = sessions->size();
+        evict(*sessions, now);
+        if (sessions->size() == count)
+        {
+            next_expiry_.store(nextExpiry(*sessions), std::memory_order_relaxed);
+            return;
+        }
+        store(std::move(sessions));
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return snapshot()->size();
+    }
+
+private:
+    std::chrono::seconds ttl_;
+    std::size_t max_sessions_;
+    std::mutex writer_mutex_;
+    std::atomic<snapshot_t> snapshot_{ std::make_shared<const std::unordered_map<std::string, std::shared_ptr<const Session>>>() };
+    std::atomic<clock_t::rep> next_expiry_{ std::numeric_limits<clock_t::rep>::max() }; //!< When the least recently used session expires at the earliest
+
+    std::shared_ptr<const Session> use(const std::string& uuid)
+    {
+        if (clock_t::now().time_since_epoch().count() >= next_expiry_.load(std::memory_order_relaxed))
+        {
+            expire();
+        }
+        const auto sessions = snapshot();
+        const auto it = sessions->find(uuid);
+        if (it == sessions->end())
+        {
+            return nullptr;
+        }
+        it->second->last_used.store(clock_t::now().time_since_epoch().count(), std::memory_order_relaxed);
+        return it->second;
+    }
+
+    void store(std::shared_ptr<std::unordered_map<std::string, std::shared_ptr<const Session>>> sessions)
+    {
+        next_expiry_.store(nextExpiry(*sessions), std::memory_order_relaxed);
+        snapshot_.store(std::move(sessions), std::memory_order_release);
+    }
+
+    [[nodiscard]] clock_t::rep nextExpiry(const std::unordered_map<std::string, std::shared_ptr<const Session>>& sessions) const
+    {
+        auto oldest = std::numeric_limits<clock_t::rep>::max();
+        for (const auto& [uuid, session] : sessions)
+        {
+            oldest = std::min(oldest, session->last_used.load(std::memory_order_relaxed));
+        }
+        return oldest == std::numeric_limits<clock_t::rep>::max() ? oldest : oldest + std::chrono::duration_cast<clock_t::duration>(ttl_).count();
+    }
+
+    void evict(std::unordered_map<std::string, std::shared_ptr<const Session>>& sessions, clock_t::time_point now) const
+    {
+        const auto expired_before = (now - ttl_).time_since_epoch().count();
+        std::erase_if(
+            sessions,
+            [expired_before](const auto& entry)
+            {
+                return entry.second->last_used.load(std::memory_order_relaxed) < expired_before;
+            });
+        if (sessions.size() <= max_sessions_)
+        {
+            return;
+        }
+
+        std::vector<std::pair<clock_t::rep, std::string>> by_use;
+        for (const auto& [uuid, session] : sessions)
+        {
+            by_use.emplace_back(session->last_used.load(std::memory_order_relaxed), uuid);
+        }
+        std::sort(by_use.begin(), by_use.end());
+        for (std::size_t i = 0; i < by_use.size() - max_sessions_; ++i)
+        {
+            sessions.erase(by_use[i].second);
+        }
+    }
+};
+
+} // namespace plugin
+
+#endif // PLUGIN_SETTINGS_STORE_H
@@ -0,0 +1,200 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+// Replaces the global operator new and delete to count the heap activity of every thread, only linked into builds
+// configured with ENABLE_ALLOC_PROFILING. Every block carries its size in a header in front of the user memory, so the
+// unsized deletes can account for it as well.
+
+#include "infill/alloc_profiler.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace
+{
+
+thread_local infill::AllocCounters counters;
+
+constexpr std::size_t header_size{ alignof(std::max_align_t) };
+
+void count(std::size_t size) noexcept
+{
+    ++counters.count;
+    counters.bytes += size;
+    counters.live += static_cast<std::int64_t>(size);
+    counters.peak = std::max(counters.peak, counters.live);
+}
+
+/*! A block of at least bytes, MSVC has no std::aligned_alloc and its aligned blocks must go back to _aligned_free */
+void* allocateBlock(std::size_t bytes, std::size_t alignment) noexcept
+{
+#ifdef _WIN32
+    return _aligned_malloc(bytes, std::max(alignment, header_size));
+#else
+    return alignment <= header_size ? std::malloc(bytes) : std::aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+#endif
+}
+
+void freeBlock(void* base) noexcept
+{
+#ifdef _WIN32
+    _aligned_free(base);
+#else
+    std::free(base);
+#endif
+}
+
+void* allocate(std::size_t size, std::size_t alignment) noexcept
+{
+    const auto header = std::max(header_size, alignment);
+    void* base = allocateBlock(size + header, alignment);
+    if (base == nullptr)
+    {
+        return nullptr;
+    }
+    auto* user = static_cast<std::byte*>(base) + header;
+    reinterpret_cast<std::size_t*>(user)[-1] = size;
+    count(size);
+    return user;
+}
+
+void deallocate(void* p, std::size_t alignment) noexcept
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    const auto size = static_cast<std::size_t*>(p)[-1];
+    counters.live -= static_cast<std::int64_t>(size);
+    freeBlock(static_cast<std::byte*>(p) - std::max(header_size, alignment));
+}
+
+void* allocateOrThrow(std::size_t size, std::size_t alignment)
+{
+    while (true)
+    {
+        if (auto* p = allocate(size, alignment))
+        {
+            return p;
+        }
+        auto handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc{};
+        }
+        handler();
+    }
+}
+
+} // namespace
+
+infill::AllocCounters& infill::threadAllocCounters() noexcept
+{
+    return counters;
+}
+
+void* operator new(std::size_t size)
+{
+    return allocateOrThrow(size, header_size);
+}
+
+void* operator new[](std::size_t size)
+{
+    return allocateOrThrow(size, header_size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size, header_size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size, header_size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete[](void* p) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    deallocate(p, header_size);
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    deallocate(p, static_cast<std::size_t>(alignment));
+}
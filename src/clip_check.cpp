@@ -0,0 +1,222 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+// Checks that clipping a layer in partitions, island by island and incrementally gives the same paths as the serial
+// clip. Every tile below the given directories is clipped against generated outlines: one contour with holes, several
+// islands, and a second layer with one island moved for the incremental clip. The parallel clips return the same paths
+// in another order, and Clipper may start a polygon at another vertex, so paths are compared in a canonical form.
+// Exits with 1 if any clip differs.
+
+#include "infill/cancellation.h"
+#include "infill/geometry.h"
+#include "infill/incremental_clip.h"
+#include "infill/islands.h"
+#include "infill/path_store.h"
+#include "infill/tile_geometry.h"
+#include "infill/work_pool.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <numbers>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+using namespace infill;
+
+using canonical_path_t = std::pair<geometry::path_kind, std::vector<std::pair<ClipperLib::cInt, ClipperLib::cInt>>>;
+
+/*! The paths sorted, polylines in their smaller direction, polygons from their smallest point in their smaller direction */
+std::vector<canonical_path_t> canonical(const geometry::path_store<>& paths)
+{
+    std::vector<canonical_path_t> ret;
+    for (std::size_t index = 0; index < paths.size(); ++index)
+    {
+        const auto kind = paths.kind(index);
+        if (kind == geometry::path_kind::discarded)
+        {
+            continue;
+        }
+        auto& [path_kind, points] = ret.emplace_back(kind, std::vector<std::pair<ClipperLib::cInt, ClipperLib::cInt>>{});
+        for (const auto& point : paths.path(index))
+        {
+            points.emplace_back(point.X, point.Y);
+        }
+        auto reversed = points;
+        if (kind == geometry::path_kind::polygon && ! points.empty())
+        {
+            std::rotate(points.begin(), std::min_element(points.begin(), points.end()), points.end());
+            reversed = points;
+            std::reverse(reversed.begin() + 1, reversed.end());
+        }
+        else
+        {
+            std::reverse(reversed.begin(), reversed.end());
+        }
+        points = std::min(points, reversed);
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool same(std::string_view name, const geometry::path_store<>& expected, const geometry::path_store<>& actual)
+{
+    const auto lhs = canonical(expected);
+    const auto rhs = canonical(actual);
+    if (lhs == rhs)
+    {
+        return true;
+    }
+    const auto [left, right] = std::mismatch(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    spdlog::error(
+        "{}: {} paths instead of {}, first difference at path {}",
+        name,
+        rhs.size(),
+        lhs.size(),
+        std::distance(lhs.begin(), left));
+    return false;
+}
+
+/*! A regular polygon with a wave on its radius, clockwise for a hole */
+geometry::polygon_outer<> blob(geometry::Point center, double radius, bool hole)
+{
+    geometry::polygon_outer<> contour;
+    constexpr int vertices{ 48 };
+    for (int i = 0; i < vertices; ++i)
+    {
+        const auto angle = (hole ? -2.0 : 2.0) * std::numbers::pi * static_cast<double>(i) / static_cast<double>(vertices);
+        const auto r = radius * (1.0 + 0.2 * std::sin(3.0 * angle));
+        contour.push_back({ center.X + static_cast<ClipperLib::cInt>(r * std::cos(angle)), center.Y + static_cast<ClipperLib::cInt>(r * std::sin(angle)) });
+    }
+    return contour;
+}
+
+/*! The outlines the tile is clipped against, each a flat even-odd set of contours */
+std::vector<std::pair<std::string, std::vector<geometry::polygon_outer<>>>> outlines(const geometry::BoundingBox& bb)
+{
+    const geometry::Point center{ (bb.front().X + bb.back().X) / 2, (bb.front().Y + bb.back().Y) / 2 };
+    const auto size = static_cast<double>(std::min(bb.back().X - bb.front().X, bb.back().Y - bb.front().Y));
+    const auto at = [&](double x, double y)
+    {
+        return geometry::Point{ center.X + static_cast<ClipperLib::cInt>(x * size), center.Y + static_cast<ClipperLib::cInt>(y * size) };
+    };
+
+    std::vector<geometry::polygon_outer<>> holes{ blob(center, 0.45 * size, false) };
+    for (const auto& hole_center : { at(-0.2, 0.0), at(0.15, 0.15), at(0.1, -0.2) })
+    {
+        holes.push_back(blob(hole_center, 0.08 * size, true));
+    }
+    std::vector<geometry::polygon_outer<>> islands;
+    for (const auto& island_center : { at(-0.3, -0.3), at(0.3, -0.3), at(0.0, 0.0), at(-0.3, 0.3), at(0.3, 0.3) })
+    {
+        islands.push_back(blob(island_center, 0.12 * size, false));
+    }
+    return { { "contour with holes", std::move(holes) }, { "islands", std::move(islands) } };
+}
+
+/*! All clips of the content against the outline that have to match its serial clip */
+bool check(const std::string& tile, const geometry::path_store<>& content, const std::string& outline_name, const std::vector<geometry::polygon_outer<>>& contours)
+{
+    const CancellationToken cancellation;
+    auto& pool = WorkPool::global();
+    const auto islands = geometry::Islands::fromContours(contours);
+    const auto serialClip = [&content](const std::vector<geometry::polygon_outer<>>& outline)
+    {
+        geometry::path_store<> serial;
+        geometry::clip(content.polylines(), false, outline, serial);
+        geometry::clip(content.polygons(), true, outline, serial);
+        return serial;
+    };
+    const auto serial = serialClip(contours);
+
+    auto ok = true;
+    for (const std::size_t partitions : { 2, 3, 8, 32 })
+    {
+        geometry::path_store<> partitioned;
+        geometry::clip(content.polylines(), false, contours, partitions, pool, cancellation, partitioned);
+        geometry::clip(content.polygons(), true, contours, partitions, pool, cancellation, partitioned);
+        ok = same(fmt::format("{}, {}, {} partitions", tile, outline_name, partitions), serial, partitioned) && ok;
+
+        geometry::path_store<> by_island;
+        geometry::clip(content.polylines(), false, islands, partitions, pool, cancellation, by_island);
+        geometry::clip(content.polygons(), true, islands, partitions, pool, cancellation, by_island);
+        ok = same(fmt::format("{}, {}, {} partitions by island", tile, outline_name, partitions), serial, by_island) && ok;
+    }
+
+    // The second layer moves the first contour, so some groups are reused and the others are clipped again.
+    auto moved = contours;
+    for (auto& point : moved.front())
+    {
+        point.X += 1;
+    }
+    const auto moved_islands = geometry::Islands::fromContours(moved);
+    for (const std::size_t partitions : { 1, 8 })
+    {
+        IncrementalClip incremental;
+        geometry::path_store<> first;
+        incremental.clip(1, content, islands, partitions, pool, cancellation, first);
+        ok = same(fmt::format("{}, {}, {} partitions incremental first layer", tile, outline_name, partitions), serial, first) && ok;
+        geometry::path_store<> second;
+        incremental.clip(1, content, moved_islands, partitions, pool, cancellation, second);
+        ok = same(fmt::format("{}, {}, {} partitions incremental moved layer", tile, outline_name, partitions), serialClip(moved), second) && ok;
+    }
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2)
+    {
+        spdlog::error("Usage: clip_check <tiles>...");
+        return 2;
+    }
+
+    auto ok = true;
+    std::size_t tiles{ 0 };
+    for (const auto& directory : std::vector<std::string>{ argv + 1, argv + argc })
+    {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator{ directory })
+        {
+            if (! entry.is_regular_file() || entry.path().extension() != ".wkt")
+            {
+                continue;
+            }
+            const auto tile = TileGeometry<>::load(entry.path());
+            geometry::path_store<> content;
+            std::vector<geometry::Point> path;
+            for (std::size_t index = 0; index < tile->paths.size(); ++index)
+            {
+                const auto kind = tile->paths.kinds[index];
+                if (kind == geometry::path_kind::discarded)
+                {
+                    continue;
+                }
+                path.clear();
+                for (const auto& point : tile->paths.points.subspan(tile->paths.offsets[index], tile->paths.offsets[index + 1] - tile->paths.offsets[index]))
+                {
+                    path.push_back({ tile->origin.X + point.X, tile->origin.Y + point.Y });
+                }
+                content.push_back(kind, path);
+            }
+            const geometry::BoundingBox bb{ tile->bounding_box.front() + tile->origin, tile->bounding_box.back() + tile->origin };
+            for (const auto& [outline_name, contours] : outlines(bb))
+            {
+                ok = check(entry.path().string(), content, outline_name, contours) && ok;
+            }
+            ++tiles;
+        }
+    }
+    spdlog::info("Checked the clips of {} tiles", tiles);
+    return ok ? 0 : 1;
+}
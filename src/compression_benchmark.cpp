@@ -0,0 +1,185 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+// Measures what gzip costs and saves on generate responses, to choose the compression threshold. Every tile below the
+// given directories is encoded as the response of a layer that is filled completely, in the protobuf wire format,
+// written by hand so the tool needs no generated code. The responses of a directory are then compressed at several
+// zlib levels the way gRPC compresses messages, deflate with a gzip header, and the best of a few runs is reported.
+
+#include "infill/tile_geometry.h"
+
+#include <docopt/docopt.h>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+
+constexpr std::string_view USAGE = R"(Gzip encode time against ratio on generate responses.
+
+Usage:
+  compression_benchmark <tiles>... [options]
+  compression_benchmark (-h | --help)
+
+Options:
+  -h --help                    Show this screen.
+  --center_x <um>              Center of the infill on the build plate in µm [default: 110000].
+  --center_y <um>              Center of the infill on the build plate in µm [default: 110000].
+  --repeat <count>             Runs per level, the fastest is reported [default: 5].
+)";
+
+/*! gRPC compresses with the default level of zlib, the others show what a different level would trade */
+constexpr std::array levels{ 1, 3, Z_DEFAULT_COMPRESSION, 9 };
+
+void appendVarint(std::string& out, std::uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+void appendField(std::string& out, std::uint32_t field, std::string_view message)
+{
+    appendVarint(out, field << 3 | 2);
+    appendVarint(out, message.size());
+    out += message;
+}
+
+/*! Point2D messages of one path, like toResponse in generate.h fills them */
+std::string encodePath(std::span<const infill::geometry::LocalPoint> path, infill::geometry::Point offset)
+{
+    std::string out;
+    std::string point;
+    for (const auto& local : path)
+    {
+        point.clear();
+        point += '\x08';
+        appendVarint(point, static_cast<std::uint64_t>(static_cast<std::int64_t>(local.X) + offset.X));
+        point += '\x10';
+        appendVarint(point, static_cast<std::uint64_t>(static_cast<std::int64_t>(local.Y) + offset.Y));
+        appendField(out, 1, point);
+    }
+    return out;
+}
+
+/*! The response of a layer covering the whole tile, its polylines and its polygons with their outline */
+std::string encodeResponse(const infill::TileGeometry<>& tile, infill::geometry::Point center)
+{
+    const auto& paths = tile.paths;
+    std::string poly_lines;
+    std::string polygons;
+    for (std::size_t index = 0; index < paths.size(); ++index)
+    {
+        const auto path = paths.points.subspan(paths.offsets[index], paths.offsets[index + 1] - paths.offsets[index]);
+        if (paths.kinds[index] == infill::geometry::path_kind::polyline)
+        {
+            appendField(poly_lines, 1, encodePath(path, center));
+        }
+        else if (paths.kinds[index] == infill::geometry::path_kind::polygon)
+        {
+            std::string polygon;
+            appendField(polygon, 1, encodePath(path, center));
+            appendField(polygons, 1, polygon);
+        }
+    }
+    std::string response;
+    appendField(response, 1, poly_lines);
+    appendField(response, 2, polygons);
+    return response;
+}
+
+/*! Compressed size of the message, as gRPC's message compression writes it */
+std::size_t gzip(std::string_view message, int level, std::vector<Bytef>& buffer)
+{
+    z_stream stream{};
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("Could not initialize deflate");
+    }
+    buffer.resize(deflateBound(&stream, static_cast<uLong>(message.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+    stream.avail_in = static_cast<uInt>(message.size());
+    stream.next_out = buffer.data();
+    stream.avail_out = static_cast<uInt>(buffer.size());
+    const auto result = deflate(&stream, Z_FINISH);
+    const auto size = stream.total_out;
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+    {
+        throw std::runtime_error("Could not deflate the response");
+    }
+    return size;
+}
+
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    const std::map<std::string, docopt::value> args = docopt::docopt(std::string{ USAGE }, { argv + 1, argv + argc }, true);
+    const infill::geometry::Point center{ args.at("--center_x").asLong(), args.at("--center_y").asLong() };
+    const auto repeat = std::max<long>(1, args.at("--repeat").asLong());
+
+    std::vector<Bytef> buffer;
+    for (const auto& directory : args.at("<tiles>").asStringList())
+    {
+        std::vector<std::string> responses;
+        std::size_t raw{ 0 };
+        for (const auto& entry : std::filesystem::recursive_directory_iterator{ directory })
+        {
+            if (entry.is_regular_file() && entry.path().extension() == ".wkt")
+            {
+                responses.push_back(encodeResponse(*infill::TileGeometry<>::load(entry.path()), center));
+                raw += responses.back().size();
+            }
+        }
+        if (responses.empty())
+        {
+            spdlog::warn("No tiles below {}", directory);
+            continue;
+        }
+        fmt::print("{}: {} responses, {:.1f} KiB on average\n", directory, responses.size(), static_cast<double>(raw) / static_cast<double>(responses.size()) / 1024.0);
+
+        for (const auto level : levels)
+        {
+            std::size_t compressed{ 0 };
+            auto fastest = std::chrono::steady_clock::duration::max();
+            for (long run = 0; run < repeat; ++run)
+            {
+                compressed = 0;
+                const auto start = std::chrono::steady_clock::now();
+                for (const auto& response : responses)
+                {
+                    compressed += gzip(response, level, buffer);
+                }
+                fastest = std::min(fastest, std::chrono::steady_clock::now() - start);
+            }
+            const auto seconds = std::chrono::duration<double>(fastest).count();
+            // Below this link speed sending the saved bytes takes longer than compressing them.
+            const auto break_even = static_cast<double>(raw - compressed) / seconds;
+            fmt::print(
+                "  level {}: {:5.1f}% of the size, {:7.1f} MB/s, {:6.2f} ms per response, pays off below {:.0f} MB/s\n",
+                level == Z_DEFAULT_COMPRESSION ? 6 : level,
+                100.0 * static_cast<double>(compressed) / static_cast<double>(raw),
+                static_cast<double>(raw) / seconds / 1e6,
+                seconds * 1e3 / static_cast<double>(responses.size()),
+                break_even / 1e6);
+        }
+    }
+}
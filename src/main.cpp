@@ -2,6 +2,7 @@
 
 #include "cura/plugins/slots/infill/v0/generate.grpc.pb.h"
 #include "cura/plugins/slots/infill/v0/generate.pb.h"
+#include "plugin/batch.h" // Offline generation of a whole layer stack
 #include "plugin/cmdline.h" // Custom command line argument definitions
 #include "plugin/handshake.h" // Handshake interface
 #include "plugin/plugin.h" // Plugin interface
@@ -12,7 +13,12 @@
 #include <grpcpp/server.h>
 #include <spdlog/spdlog.h> // Logging library
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <map>
+#include <memory>
+#include <string>
 
 using namespace cura::plugins::slots::infill::v0;
 
@@ -27,13 +33,87 @@ int main(int argc, const char** argv)
                                         cura::plugins::slots::infill::v0::generate::CallResponse,
                                         cura::plugins::slots::infill::v0::generate::CallRequest>;
 
+    std::shared_ptr<infill::SharedTileCache> shared_tile_cache;
+    if (const auto shared_tile_cache_path = args.at("--shared_tile_cache").asString(); ! shared_tile_cache_path.empty())
+    {
+        shared_tile_cache = std::make_shared<infill::SharedTileCache>(shared_tile_cache_path);
+    }
+
+    std::shared_ptr<infill::ResultCache> result_cache;
+    if (const auto result_cache_path = args.at("--result_cache").asString(); ! result_cache_path.empty())
+    {
+        result_cache = std::make_shared<infill::ResultCache>(result_cache_path, static_cast<std::size_t>(args.at("--result_cache_size").asLong()) << 20, plugin::cmdline::VERSION);
+    }
+
+    std::shared_ptr<infill::IncrementalClip> incremental_clip;
+    if (const auto incremental_layers = args.at("--incremental_layers").asLong(); incremental_layers > 0)
+    {
+        incremental_clip = std::make_shared<infill::IncrementalClip>(static_cast<std::size_t>(incremental_layers));
+    }
+
+    if (args.at("--perf_counters").asBool())
+    {
+        infill::PerfCounters::global().enable();
+    }
+    infill::MemoryGovernor::global().start(static_cast<std::size_t>(args.at("--memory_budget").asLong()) << 20);
+
+    const infill::InfillGenerator generator{ .clip_partitions = static_cast<std::size_t>(args.at("--clip_partitions").asLong()),
+                                             .tile_cache = std::make_shared<infill::TileCache>(static_cast<std::size_t>(args.at("--tile_cache_size").asLong()) << 20, shared_tile_cache),
+                                             .result_cache = result_cache,
+                                             .incremental_clip = incremental_clip };
+
+    if (args.at("batch").asBool())
+    {
+        const auto center = infill::InfillGenerator::infillCenter(
+            std::stold(args.at("--machine_width").asString()),
+            std::stold(args.at("--machine_depth").asString()),
+            std::stold(args.at("--center_x").asString()),
+            std::stold(args.at("--center_y").asString()));
+        const plugin::Batch batch{ .outlines_path = args.at("<outlines>").asString(),
+                                   .tiles_path = args.at("--tiles_path").asString(),
+                                   .pattern = args.at("--pattern").asString(),
+                                   .infill_scale = args.at("--infill_scale").asLong(),
+                                   .center_x = center.first,
+                                   .center_y = center.second,
+                                   .output_path = args.at("--output").asString(),
+                                   .generator = generator };
+        const auto failed = batch.run();
+        infill::AllocProfiler::global().report();
+        return failed == 0 ? 0 : 1;
+    }
+
     plugin::Plugin<generate_t> plugin{ args.at("--address").asString(), args.at("--port").asString(), grpc::InsecureServerCredentials() };
+    const auto max_message_size = static_cast<std::size_t>(args.at("--max_message_size").asLong()) << 20;
+    plugin.setMaxMessageSize(static_cast<int>(std::min<std::size_t>(max_message_size, std::numeric_limits<int>::max())));
     plugin.addHandshakeService(plugin::Handshake{ .metadata = plugin.metadata });
 
-    auto broadcast_settings = std::make_shared<plugin::Broadcast::settings_t>();
+    auto metrics = std::make_shared<plugin::Metrics>(
+        std::chrono::seconds{ args.at("--metrics_interval").asLong() },
+        max_message_size,
+        std::chrono::seconds{ args.at("--session_ttl").asLong() });
+    auto scheduler = std::make_shared<plugin::FairScheduler>(
+        static_cast<std::size_t>(args.at("--workers").asLong()),
+        static_cast<std::size_t>(args.at("--max_queue_depth").asLong()),
+        metrics);
+
+    auto broadcast_settings = std::make_shared<plugin::Broadcast::settings_t>(
+        std::chrono::seconds{ args.at("--session_ttl").asLong() },
+        static_cast<std::size_t>(args.at("--max_sessions").asLong()));
     plugin.addBroadcastService(plugin::Broadcast{ .settings = broadcast_settings });
-    plugin.addGenerateService(generate_t{ .settings = broadcast_settings, .metadata = plugin.metadata, .tiles_path = args.at("--tiles_path").asString() });
+    plugin.addGenerateService(generate_t{ .settings = broadcast_settings,
+                                          .metadata = plugin.metadata,
+                                          .tiles_path = args.at("--tiles_path").asString(),
+                                          .generator = generator,
+                                          .scheduler = scheduler,
+                                          .compression_threshold = static_cast<std::size_t>(args.at("--compression_threshold").asLong()) << 10 });
+    plugin.addGenerateLayersService(plugin::GenerateLayers{ .generator = generator,
+                                                            .scheduler = scheduler,
+                                                            .max_in_flight = std::min<std::size_t>(
+                                                                static_cast<std::size_t>(args.at("--workers").asLong()) * 2,
+                                                                static_cast<std::size_t>(args.at("--max_queue_depth").asLong())) });
     plugin.start();
     plugin.run();
     plugin.stop();
+    metrics->report();
+    infill::AllocProfiler::global().report();
 }
\ No newline at end of file
@@ -0,0 +1,179 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+// Build step compiling tile sets into the plugin. Every directory below <tiles> holding <z>_<pattern>.wkt files is one
+// set, named like the directory. The tiles are parsed here, on the build host, and written to <output> as arrays in
+// the flat layout of TileGeometry, ordered by set, pattern and z, so the plugin serves them without reading a file.
+
+#include "infill/tile_geometry.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace
+{
+
+struct Layer
+{
+    std::string set;
+    std::string pattern;
+    std::int64_t z;
+    std::filesystem::path filepath;
+};
+
+std::string literal(std::string_view text)
+{
+    std::string quoted{ "\"" };
+    for (const auto c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+void writeArray(std::string& out, std::string_view type, std::string_view name, std::size_t size, const auto& format)
+{
+    fmt::format_to(std::back_inserter(out), "constexpr std::array<{}, {}> {}{{ {{\n", type, size, name);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        out += format(i);
+        out += (i + 1) % 8 == 0 ? ",\n" : ", ";
+    }
+    out += "} };\n";
+}
+
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    if (argc != 3)
+    {
+        spdlog::error("Usage: tile_embedder <tiles> <output>");
+        return 2;
+    }
+    const std::filesystem::path tiles_path{ argv[1] };
+    const std::filesystem::path output_path{ argv[2] };
+
+    std::vector<Layer> layers;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator{ tiles_path })
+    {
+        const auto stem = entry.path().stem().string();
+        const auto separator = stem.find('_');
+        std::int64_t z{ 0 };
+        if (! entry.is_regular_file() || entry.path().extension() != ".wkt" || separator == std::string::npos
+            || std::from_chars(stem.data(), stem.data() + separator, z).ptr != stem.data() + separator)
+        {
+            continue;
+        }
+        layers.push_back({ .set = entry.path().parent_path().filename().string(), .pattern = stem.substr(separator + 1), .z = z, .filepath = entry.path() });
+    }
+    std::sort(
+        layers.begin(),
+        layers.end(),
+        [](const Layer& lhs, const Layer& rhs)
+        {
+            return std::tie(lhs.set, lhs.pattern, lhs.z) < std::tie(rhs.set, rhs.pattern, rhs.z);
+        });
+    const auto duplicate = std::adjacent_find(
+        layers.begin(),
+        layers.end(),
+        [](const Layer& lhs, const Layer& rhs)
+        {
+            return std::tie(lhs.set, lhs.pattern, lhs.z) == std::tie(rhs.set, rhs.pattern, rhs.z);
+        });
+    if (duplicate != layers.end())
+    {
+        spdlog::error("{} and {} would be embedded under the same name", duplicate->filepath.string(), std::next(duplicate)->filepath.string());
+        return 1;
+    }
+
+    std::string out;
+    out += "// Generated by tile_embedder, do not edit.\n\n";
+    out += "#include \"infill/embedded_tiles.h\"\n\n#include <array>\n#include <cstddef>\n#include <span>\n\n";
+    out += "namespace infill\n{\n\nnamespace\n{\n\n";
+    std::string index;
+    for (std::size_t n = 0; n < layers.size(); ++n)
+    {
+        const auto& layer = layers[n];
+        try
+        {
+            const auto tile = infill::TileGeometry<>::load(layer.filepath);
+            const auto& paths = tile->paths;
+            writeArray(
+                out,
+                "std::size_t",
+                fmt::format("offsets_{}", n),
+                paths.offsets.size(),
+                [&](std::size_t i)
+                {
+                    return fmt::format("{}", paths.offsets[i]);
+                });
+            writeArray(
+                out,
+                "geometry::path_kind",
+                fmt::format("kinds_{}", n),
+                paths.kinds.size(),
+                [&](std::size_t i)
+                {
+                    return fmt::format("geometry::path_kind{{ {} }}", static_cast<int>(paths.kinds[i]));
+                });
+            writeArray(
+                out,
+                "geometry::LocalPoint",
+                fmt::format("points_{}", n),
+                paths.points.size(),
+                [&](std::size_t i)
+                {
+                    return fmt::format("geometry::LocalPoint{{ {}, {} }}", paths.points[i].X, paths.points[i].Y);
+                });
+            out += '\n';
+            fmt::format_to(
+                std::back_inserter(index),
+                "    EmbeddedTile{{ .set = {}, .pattern = {}, .z = {}, .origin_x = {}, .origin_y = {}, .bounding_box = {{ {}, {}, {}, {} }}, "
+                ".offsets = offsets_{}, .kinds = kinds_{}, .points = points_{} }},\n",
+                literal(layer.set),
+                literal(layer.pattern),
+                layer.z,
+                tile->origin.X,
+                tile->origin.Y,
+                tile->bounding_box.front().X,
+                tile->bounding_box.front().Y,
+                tile->bounding_box.back().X,
+                tile->bounding_box.back().Y,
+                n,
+                n,
+                n);
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::error("Could not embed {}: {}", layer.filepath.string(), e.what());
+            return 1;
+        }
+    }
+    fmt::format_to(std::back_inserter(out), "constexpr std::array<EmbeddedTile, {}> tiles{{ {{\n{}}} }};\n\n", layers.size(), index);
+    out += "} // namespace\n\nstd::span<const EmbeddedTile> embeddedTiles() noexcept\n{\n    return tiles;\n}\n\n} // namespace infill\n";
+
+    std::ofstream file{ output_path, std::ios::binary | std::ios::trunc };
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    if (! file)
+    {
+        spdlog::error("Could not write {}", output_path.string());
+        return 1;
+    }
+    spdlog::info("Embedded {} tiles from {}", layers.size(), tiles_path.string());
+}
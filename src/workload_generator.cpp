@@ -0,0 +1,292 @@
+// Copyright (c) 2024 Michael Jaeger, Marie Schmid
+// curaengine_plugin_generate_infill is released under the terms of the AGPLv3 or higher
+
+// Writes reproducible tile stacks and matching outline sets of any size, to test the plugin at production scale. The
+// tiles are named <z>_<pattern>.wkt like the tiles of the plugin, the outlines <z>.wkt like the input of its batch
+// subcommand. The same seed and options produce the same files on the same platform and toolchain. The random numbers
+// are the same everywhere, they are taken from the raw output of std::mt19937_64, which the standard fixes, rather than
+// from the std distributions, which it does not. The shapes go through std::sin and std::cos, whose last bits differ
+// between math libraries, so a point may land one unit apart elsewhere.
+
+#include "infill/work_pool.h"
+
+#include <docopt/docopt.h>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <numbers>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+constexpr std::string_view USAGE = R"(Synthetic workloads for the layered infill plugin.
+
+Usage:
+  workload_generator <tiles> <outlines> [options]
+  workload_generator (-h | --help)
+
+Options:
+  -h --help                    Show this screen.
+  --seed <seed>                Seed of the random numbers, the same seed gives the same files with the same toolchain [default: 1].
+  --layers <count>             Number of layers [default: 100].
+  --layer_height <um>          Distance between two layers in µm [default: 200].
+  --kind <kind>                Tile content, one of gyroid, lattice or segments [default: gyroid].
+  --segments <count>           Line segments per tile layer [default: 100000].
+  --polygons <count>           Closed polygons per tile layer [default: 0].
+  --tile_size <um>             Edge length of the square tile in µm [default: 20000].
+  --pattern <pattern>          Pattern in the names of the tile files [default: layered_infill].
+  --outlines <count>           Outer contours per layer [default: 4].
+  --holes <count>              Holes per outer contour [default: 2].
+  --outline_vertices <count>   Vertices per outer contour, holes get a quarter of them [default: 256].
+  --outline_size <um>          Edge length of the square the outer contours are spread over in µm [default: 100000].
+  --center_x <um>              Center of the outlines on the build plate in µm [default: 110000].
+  --center_y <um>              Center of the outlines on the build plate in µm [default: 110000].
+)";
+
+constexpr std::array<std::string_view, 3> tile_kinds{ "gyroid", "lattice", "segments" };
+
+using point_t = std::pair<std::int64_t, std::int64_t>;
+using path_t = std::vector<point_t>;
+
+struct Options
+{
+    std::uint64_t seed;
+    std::int64_t layer_height;
+    std::string kind;
+    std::int64_t segments;
+    std::int64_t polygons;
+    std::int64_t tile_size;
+    std::int64_t outlines;
+    std::int64_t holes;
+    std::int64_t outline_vertices;
+    std::int64_t outline_size;
+    point_t center;
+};
+
+void appendPath(std::string& text, std::string_view kind, const path_t& path)
+{
+    const auto closed = kind == "POLYGON";
+    text += kind;
+    text += closed ? " ((" : " (";
+    for (const auto& [x, y] : path)
+    {
+        fmt::format_to(std::back_inserter(text), "{} {}, ", x, y);
+    }
+    if (closed)
+    {
+        fmt::format_to(std::back_inserter(text), "{} {}, ", path.front().first, path.front().second);
+    }
+    text.resize(text.size() - 2);
+    text += closed ? "))\n" : ")\n";
+}
+
+void writeFile(const std::filesystem::path& filepath, const std::string& text)
+{
+    std::ofstream file{ filepath, std::ios::binary | std::ios::trunc };
+    file.write(text.data(), static_cast<std::streamsize>(text.size()));
+    if (! file)
+    {
+        throw std::runtime_error(fmt::format("Could not write {}", filepath.string()));
+    }
+}
+
+/*! Random numbers of one layer, independent of the order in which the layers are generated */
+std::mt19937_64 layerRandom(std::uint64_t seed, std::uint32_t stream, std::int64_t layer)
+{
+    std::seed_seq sequence{ static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32), stream, static_cast<std::uint32_t>(layer) };
+    return std::mt19937_64{ sequence };
+}
+
+/*! Uniform in [low, high], the modulo bias is far below what test data could show */
+std::int64_t uniformInt(std::mt19937_64& random, std::int64_t low, std::int64_t high)
+{
+    return low + static_cast<std::int64_t>(random() % (static_cast<std::uint64_t>(high - low) + 1));
+}
+
+/*! Uniform in [low, high), from the upper 53 bits of one draw */
+double uniformReal(std::mt19937_64& random, double low, double high)
+{
+    return low + (high - low) * static_cast<double>(random() >> 11) * 0x1.0p-53;
+}
+
+/*! A regular polygon with some noise on its radius */
+path_t blob(std::mt19937_64& random, point_t center, double radius, std::int64_t vertices, double phase)
+{
+    path_t path;
+    path.reserve(static_cast<std::size_t>(vertices));
+    for (std::int64_t i = 0; i < vertices; ++i)
+    {
+        const auto angle = 2.0 * std::numbers::pi * static_cast<double>(i) / static_cast<double>(vertices);
+        const auto r = radius * (1.0 + 0.15 * std::sin(5.0 * angle + phase) + uniformReal(random, -0.03, 0.03));
+        path.emplace_back(center.first + static_cast<std::int64_t>(r * std::cos(angle)), center.second + static_cast<std::int64_t>(r * std::sin(angle)));
+    }
+    return path;
+}
+
+/*! Tile content of one layer, starting with the bounding box polygon the plugin expects first */
+std::string tileLayer(const Options& options, std::int64_t layer, std::int64_t z)
+{
+    auto random = layerRandom(options.seed, 0, layer);
+    const auto half = options.tile_size / 2;
+    std::string text;
+    appendPath(text, "POLYGON", { { -half, -half }, { -half, half }, { half, half }, { half, -half } });
+
+    const auto lines = std::max<std::int64_t>(1, static_cast<std::int64_t>(std::sqrt(static_cast<double>(options.segments))));
+    const auto segments_per_line = std::max<std::int64_t>(1, options.segments / lines);
+    const auto spacing = static_cast<double>(options.tile_size) / static_cast<double>(lines);
+    const auto along = [&](std::int64_t step)
+    {
+        return -half + options.tile_size * step / segments_per_line;
+    };
+    if (options.kind == "gyroid")
+    {
+        // Sine waves whose phase moves with z and whose direction alternates, like the cross sections of a gyroid.
+        const auto period = static_cast<double>(options.tile_size) / 4.0;
+        const auto phase = 2.0 * std::numbers::pi * static_cast<double>(z) / period;
+        const auto swap = layer % 2 == 1;
+        for (std::int64_t line = 0; line < lines; ++line)
+        {
+            const auto offset = -static_cast<double>(half) + spacing * (static_cast<double>(line) + 0.5);
+            path_t path;
+            for (std::int64_t step = 0; step <= segments_per_line; ++step)
+            {
+                const auto u = along(step);
+                const auto v = static_cast<std::int64_t>(offset + spacing / 3.0 * std::sin(2.0 * std::numbers::pi * static_cast<double>(u) / period + phase));
+                path.emplace_back(swap ? v : u, swap ? u : v);
+            }
+            appendPath(text, "LINESTRING", path);
+        }
+    }
+    else if (options.kind == "lattice")
+    {
+        // A grid of straight lines in both directions, every line split into the same number of segments.
+        for (std::int64_t line = 0; line < lines; ++line)
+        {
+            const auto offset = static_cast<std::int64_t>(-static_cast<double>(half) + spacing * (static_cast<double>(line) + 0.5));
+            path_t path;
+            for (std::int64_t step = 0; step <= segments_per_line / 2; ++step)
+            {
+                path.emplace_back(-half + options.tile_size * step / std::max<std::int64_t>(1, segments_per_line / 2), offset);
+            }
+            appendPath(text, "LINESTRING", path);
+            for (auto& point : path)
+            {
+                point = { point.second, point.first };
+            }
+            appendPath(text, "LINESTRING", path);
+        }
+    }
+    else if (options.kind == "segments")
+    {
+        for (std::int64_t segment = 0; segment < options.segments; ++segment)
+        {
+            const point_t start{ uniformInt(random, -half, half), uniformInt(random, -half, half) };
+            const auto a = uniformReal(random, 0.0, 2.0 * std::numbers::pi);
+            const auto l = uniformReal(random, 0.0, static_cast<double>(options.tile_size) / 20.0);
+            const point_t end{ std::clamp<std::int64_t>(start.first + static_cast<std::int64_t>(l * std::cos(a)), -half, half),
+                               std::clamp<std::int64_t>(start.second + static_cast<std::int64_t>(l * std::sin(a)), -half, half) };
+            appendPath(text, "LINESTRING", { start, end });
+        }
+    }
+    else
+    {
+        throw std::invalid_argument(fmt::format("Unknown tile kind {}", options.kind));
+    }
+
+    for (std::int64_t polygon = 0; polygon < options.polygons; ++polygon)
+    {
+        const point_t center{ uniformInt(random, -half * 9 / 10, half * 9 / 10), uniformInt(random, -half * 9 / 10, half * 9 / 10) };
+        const auto radius = uniformReal(random, static_cast<double>(options.tile_size) / 400.0, static_cast<double>(options.tile_size) / 100.0);
+        appendPath(text, "POLYGON", blob(random, center, radius, 6, 0.0));
+    }
+    return text;
+}
+
+/*! Outer contours spread over a grid, each with holes around its center */
+std::string outlineLayer(const Options& options, std::int64_t layer, std::int64_t z)
+{
+    auto random = layerRandom(options.seed, 1, layer);
+    const auto columns = std::max<std::int64_t>(1, static_cast<std::int64_t>(std::ceil(std::sqrt(static_cast<double>(options.outlines)))));
+    const auto cell = static_cast<double>(options.outline_size) / static_cast<double>(columns);
+    const auto phase = static_cast<double>(z) / 5000.0;
+    std::string text;
+    for (std::int64_t outline = 0; outline < options.outlines; ++outline)
+    {
+        const point_t center{ options.center.first + static_cast<std::int64_t>((static_cast<double>(outline % columns) + 0.5) * cell - static_cast<double>(options.outline_size) / 2.0),
+                              options.center.second + static_cast<std::int64_t>((static_cast<double>(outline / columns) + 0.5) * cell - static_cast<double>(options.outline_size) / 2.0) };
+        const auto radius = cell * 0.4;
+        appendPath(text, "POLYGON", blob(random, center, radius, options.outline_vertices, phase));
+        for (std::int64_t hole = 0; hole < options.holes; ++hole)
+        {
+            const auto angle = 2.0 * std::numbers::pi * static_cast<double>(hole) / static_cast<double>(options.holes);
+            const point_t hole_center{ center.first + static_cast<std::int64_t>(radius * 0.45 * std::cos(angle)), center.second + static_cast<std::int64_t>(radius * 0.45 * std::sin(angle)) };
+            auto path = blob(random, hole_center, radius * 0.8 / (2.0 + static_cast<double>(options.holes)), std::max<std::int64_t>(3, options.outline_vertices / 4), phase);
+            std::reverse(path.begin(), path.end());
+            appendPath(text, "POLYGON", path);
+        }
+    }
+    return text;
+}
+
+} // namespace
+
+int main(int argc, const char** argv)
+{
+    const std::map<std::string, docopt::value> args = docopt::docopt(std::string{ USAGE }, { argv + 1, argv + argc }, true);
+
+    const Options options{ .seed = static_cast<std::uint64_t>(args.at("--seed").asLong()),
+                           .layer_height = args.at("--layer_height").asLong(),
+                           .kind = args.at("--kind").asString(),
+                           .segments = args.at("--segments").asLong(),
+                           .polygons = args.at("--polygons").asLong(),
+                           .tile_size = args.at("--tile_size").asLong(),
+                           .outlines = args.at("--outlines").asLong(),
+                           .holes = args.at("--holes").asLong(),
+                           .outline_vertices = args.at("--outline_vertices").asLong(),
+                           .outline_size = args.at("--outline_size").asLong(),
+                           .center = { args.at("--center_x").asLong(), args.at("--center_y").asLong() } };
+    const std::filesystem::path tiles_path{ args.at("<tiles>").asString() };
+    const std::filesystem::path outlines_path{ args.at("<outlines>").asString() };
+    const auto pattern = args.at("--pattern").asString();
+    const auto layers = args.at("--layers").asLong();
+    if (std::ranges::find(tile_kinds, options.kind) == tile_kinds.end())
+    {
+        spdlog::error("Unknown tile kind {}, expected one of {}", options.kind, fmt::join(tile_kinds, ", "));
+        return 1;
+    }
+    std::filesystem::create_directories(tiles_path);
+    std::filesystem::create_directories(outlines_path);
+
+    // Layers are independent, each draws from its own seeded generator, so the files do not depend on the thread count.
+    std::atomic<std::int64_t> written{ 0 };
+    infill::WorkPool::global().parallelFor(
+        static_cast<std::size_t>(layers),
+        [&](std::size_t index)
+        {
+            const auto layer = static_cast<std::int64_t>(index);
+            const auto z = (layer + 1) * options.layer_height;
+            writeFile(tiles_path / fmt::format("{}_{}.wkt", z, pattern), tileLayer(options, layer, z));
+            writeFile(outlines_path / fmt::format("{}.wkt", z), outlineLayer(options, layer, z));
+            if (const auto done = ++written; done % 100 == 0)
+            {
+                spdlog::info("Wrote {} of {} layers", done, layers);
+            }
+        });
+    spdlog::info("Wrote {} layers of {} tiles to {} and their outlines to {}", layers, options.kind, tiles_path.string(), outlines_path.string());
+}